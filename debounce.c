@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include <avr/io.h>
+#include "matrix.h"
+#include "debounce.h"
+
+#if DEBOUNCE_ALGORITHM == DEBOUNCE_EAGER
+
+/* Consecutive scans each key has read released while still reported pressed */
+static uint8_t debounce_count[COLUMN_COUNT][ROW_COUNT] = { { 0, }, };
+
+void debounce_update(const uint8_t raw[COLUMN_COUNT], uint8_t state[COLUMN_COUNT]) {
+    for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+        uint8_t pressed = raw[i] | state[i];
+        if (pressed == 0x00) {
+            continue;
+        }
+        for (uint8_t j = 0; j < ROW_COUNT; ++j) {
+            if (raw[i] & _BV(j)) {
+                state[i] |= _BV(j);
+                debounce_count[i][j] = 0;
+            } else if (state[i] & _BV(j)) {
+                if (++debounce_count[i][j] >= DEBOUNCE_TICKS) {
+                    state[i] &= ~_BV(j);
+                    debounce_count[i][j] = 0;
+                }
+            }
+        }
+    }
+}
+
+#elif DEBOUNCE_ALGORITHM == DEBOUNCE_DEFERRED
+
+/* Consecutive scans each key has read different from its reported state */
+static uint8_t debounce_count[COLUMN_COUNT][ROW_COUNT] = { { 0, }, };
+
+void debounce_update(const uint8_t raw[COLUMN_COUNT], uint8_t state[COLUMN_COUNT]) {
+    for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+        uint8_t delta = raw[i] ^ state[i];
+        for (uint8_t j = 0; j < ROW_COUNT; ++j) {
+            if (!(delta & _BV(j))) {
+                debounce_count[i][j] = 0;
+            } else if (++debounce_count[i][j] >= DEBOUNCE_TICKS) {
+                state[i] ^= _BV(j);
+                debounce_count[i][j] = 0;
+            }
+        }
+    }
+}
+
+#elif DEBOUNCE_ALGORITHM == DEBOUNCE_VERTICAL
+
+/*
+** 3-bit counters stored as bit planes, bit j of plane n holds bit n of the
+** counter of row j, so a whole column is counted with a few byte operations.
+*/
+static uint8_t debounce_plane[3][COLUMN_COUNT] = { { 0, }, };
+
+#define DEBOUNCE_MATCH(plane, n) \
+    (((DEBOUNCE_TICKS - 1) & _BV(n)) ? (plane) : (uint8_t)~(plane))
+
+void debounce_update(const uint8_t raw[COLUMN_COUNT], uint8_t state[COLUMN_COUNT]) {
+    for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+        uint8_t delta = raw[i] ^ state[i];
+        uint8_t c0 = debounce_plane[0][i] & delta;
+        uint8_t c1 = debounce_plane[1][i] & delta;
+        uint8_t c2 = debounce_plane[2][i] & delta;
+
+        uint8_t settled = delta & DEBOUNCE_MATCH(c0, 0) & DEBOUNCE_MATCH(c1, 1) & DEBOUNCE_MATCH(c2, 2);
+        state[i] ^= settled;
+
+        uint8_t count = delta & ~settled;
+        uint8_t carry = c0 & count;
+        c0 ^= count;
+        c1 ^= carry;
+        carry &= c1 ^ carry;
+        c2 ^= carry;
+
+        debounce_plane[0][i] = c0 & ~settled;
+        debounce_plane[1][i] = c1 & ~settled;
+        debounce_plane[2][i] = c2 & ~settled;
+    }
+}
+
+#else
+#error "unknown DEBOUNCE_ALGORITHM"
+#endif
@@ -0,0 +1,23 @@
+#ifndef DEBOUNCE_H
+#define DEBOUNCE_H
+
+#include <stdint.h>
+#include "matrix.h"
+
+#define DEBOUNCE_EAGER 1 /* eager on press, deferred on release */
+#define DEBOUNCE_DEFERRED 2 /* deferred on press and release */
+#define DEBOUNCE_VERTICAL 3 /* deferred, bit-sliced vertical counters */
+
+#ifndef DEBOUNCE_ALGORITHM
+#define DEBOUNCE_ALGORITHM DEBOUNCE_EAGER
+#endif
+
+/* Scans a key has to stay stable before a deferred change is taken */
+#ifndef DEBOUNCE_TICKS
+#define DEBOUNCE_TICKS 5
+#endif
+static_assert(DEBOUNCE_TICKS >= 1 && DEBOUNCE_TICKS <= 8);
+
+void debounce_update(const uint8_t raw[COLUMN_COUNT], uint8_t state[COLUMN_COUNT]);
+
+#endif
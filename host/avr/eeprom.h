@@ -0,0 +1,30 @@
+#ifndef HOST_AVR_EEPROM_H
+#define HOST_AVR_EEPROM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/* EEMEM objects are plain zero-initialised memory, writes are counted */
+#define EEMEM
+
+extern uint16_t host_eeprom_writes;
+
+#define eeprom_is_ready() (true)
+
+static inline uint8_t eeprom_read_byte(const uint8_t *address) {
+    return *address;
+}
+
+static inline void eeprom_read_block(void *destination, const void *source, size_t size) {
+    memcpy(destination, source, size);
+}
+
+static inline void eeprom_update_byte(uint8_t *address, uint8_t value) {
+    if (*address != value) {
+        *address = value;
+        ++host_eeprom_writes;
+    }
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#define sei() ((void)0)
+#define cli() ((void)0)
+
+#define ISR_BLOCK
+#define ISR(vector, ...) void vector(void)
+
+#endif
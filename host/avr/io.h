@@ -0,0 +1,139 @@
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+/*
+** Fake port layer for host builds.
+** Registers are plain variables, PIND is sampled from the simulated matrix.
+*/
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+#define bit_is_set(sfr, bit) ((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!((sfr) & _BV(bit)))
+#define loop_until_bit_is_set(sfr, bit) do { } while (bit_is_clear(sfr, bit))
+#define loop_until_bit_is_clear(sfr, bit) do { } while (bit_is_set(sfr, bit))
+
+extern volatile uint8_t PORTB, DDRB;
+extern volatile uint8_t PORTC, DDRC;
+extern volatile uint8_t PORTD, DDRD;
+extern volatile uint8_t PORTF, DDRF;
+
+uint8_t host_pinb_read(void);
+uint8_t host_pind_read(void);
+uint8_t host_pinf_read(void);
+#define PINB host_pinb_read()
+#define PIND host_pind_read()
+#define PINF host_pinf_read()
+
+extern volatile uint8_t TCCR1A, TCCR1B;
+extern volatile uint16_t TCNT1;
+
+/*
+** USB device controller, modelled by host/usbctl.c. Endpoint registers are
+** banked by UENUM. UEINTX and UEDATX go through the model on every access so
+** that clearing a flag or touching the FIFO has the hardware's side effects.
+*/
+extern volatile uint8_t UHWCON, PLLCSR, USBCON, UDCON, UDIEN, UDINT, UDADDR;
+extern volatile uint8_t UENUM, UERST;
+extern volatile uint16_t UDFNUM;
+
+typedef struct {
+    volatile uint8_t ueconx;
+    volatile uint8_t uecfg0x;
+    volatile uint8_t uecfg1x;
+    volatile uint8_t ueienx;
+} host_endpoint_registers_t;
+extern host_endpoint_registers_t host_endpoint_registers[8];
+
+volatile uint8_t *host_ueintx(void);
+volatile uint8_t *host_uedatx(void);
+uint8_t host_uebclx(void);
+uint8_t host_uesta0x(void);
+uint8_t host_ueint(void);
+#define UECONX (host_endpoint_registers[UENUM & 7].ueconx)
+#define UECFG0X (host_endpoint_registers[UENUM & 7].uecfg0x)
+#define UECFG1X (host_endpoint_registers[UENUM & 7].uecfg1x)
+#define UEIENX (host_endpoint_registers[UENUM & 7].ueienx)
+#define UEINTX (*host_ueintx())
+#define UEDATX (*host_uedatx())
+#define UEBCLX host_uebclx()
+#define UESTA0X host_uesta0x()
+#define UEINT host_ueint()
+
+/*
+** USART1, modelled by the loopback in host/link.c and the log capture in
+** host/enumerate.c. UDR1 goes through the model so that it can tell a
+** transmitted byte from an idle interrupt.
+*/
+extern volatile uint8_t UCSR1A, UCSR1B, UCSR1C;
+extern volatile uint16_t UBRR1;
+volatile uint8_t *host_udr1(void);
+#define UDR1 (*host_udr1())
+
+#define UVREGE 0
+#define PLOCK 0
+#define PLLE 1
+#define PINDIV 4
+#define OTGPADE 4
+#define FRZCLK 5
+#define USBE 7
+#define DETACH 0
+#define RMWKUP 1
+#define LSM 2
+#define SUSPI 0
+#define SOFI 2
+#define EORSTI 3
+#define WAKEUPI 4
+#define SUSPE 0
+#define SOFE 2
+#define EORSTE 3
+#define WAKEUPE 4
+#define EPRST0 0
+#define EPRST1 1
+#define EPRST2 2
+#define EPRST3 3
+#define EPEN 0
+#define STALLRQ 5
+#define CFGOK 7
+#define TXINI 0
+#define STALLEDI 1
+#define RXOUTI 2
+#define RXSTPI 3
+#define NAKOUTI 4
+#define RWAL 5
+#define NAKINI 6
+#define FIFOCON 7
+
+#define CS10 0
+
+#define FE1 4
+#define DOR1 3
+#define U2X1 1
+#define RXCIE1 7
+#define UDRIE1 5
+#define RXEN1 4
+#define TXEN1 3
+#define UCSZ11 2
+#define UCSZ10 1
+
+#define PORTB0 0
+#define PORTB1 1
+#define PORTB2 2
+#define PORTB3 3
+#define PORTB4 4
+#define PORTB5 5
+#define PORTB6 6
+#define PORTB7 7
+
+#define PORTF0 0
+#define PORTF1 1
+#define PORTF4 4
+#define PORTF5 5
+#define PORTF6 6
+#define PORTF7 7
+
+#define PORT7 7
+#define DDC7 7
+
+#endif
@@ -0,0 +1,348 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include "port.h"
+#include "../matrix.h"
+#include "../debounce.h"
+#include "../report.h"
+#include "../keymap.h"
+#include "../scheduler.h"
+#include "../usb.h"
+
+/*
+** Host benchmark of the scan-and-report pipeline.
+**
+** Replays scripted key timelines against the fake port layer, one scan per
+** scheduler tick, and drains the report the way the SOF interrupt does every
+** POLL_INTERVAL scans (bInterval of EP1).
+*/
+
+#define POLL_INTERVAL SCHEDULER_MS(USB_POLL_INTERVAL)
+#define REPEAT 200
+#define PROBE_LIMIT 64
+#define PENDING_MAX 64
+
+typedef struct {
+    uint16_t scan;
+    uint8_t column;
+    uint8_t row;
+    bool pressed;
+    bool bounce; /* contact chatter, must not reach the host */
+} key_event_t;
+
+typedef struct {
+    const char *name;
+    const key_event_t *events;
+    uint16_t event_count;
+    uint16_t scan_count;
+} timeline_t;
+
+#define PRESS(SCAN, COLUMN, ROW) { SCAN, COLUMN, ROW, true, false }
+#define RELEASE(SCAN, COLUMN, ROW) { SCAN, COLUMN, ROW, false, false }
+#define CHATTER(SCAN, COLUMN, ROW, PRESSED) { SCAN, COLUMN, ROW, PRESSED, true }
+#define TIMELINE(NAME, EVENTS, SCANS) \
+    { .name = NAME, .events = EVENTS, .event_count = sizeof(EVENTS) / sizeof(EVENTS[0]), .scan_count = SCANS }
+
+static const key_event_t tap[] = {
+    PRESS(5, 2, 2),
+    RELEASE(85, 2, 2),
+};
+
+static const key_event_t chord[] = {
+    PRESS(5, 0, 4), /* LEFTSHIFT */
+    PRESS(30, 1, 3), /* A */
+    RELEASE(90, 1, 3),
+    PRESS(120, 2, 3), /* S */
+    RELEASE(180, 2, 3),
+    RELEASE(220, 0, 4),
+};
+
+static const key_event_t typing[] = {
+    PRESS(5, 5, 2), /* T */
+    PRESS(45, 8, 3), /* H */
+    RELEASE(65, 5, 2),
+    PRESS(85, 3, 2), /* E */
+    RELEASE(105, 8, 3),
+    PRESS(125, 6, 2), /* SPACE */
+    RELEASE(145, 3, 2),
+    PRESS(165, 3, 4), /* C */
+    RELEASE(185, 6, 2),
+    PRESS(205, 1, 3), /* A */
+    RELEASE(225, 3, 4),
+    PRESS(245, 5, 2), /* T */
+    RELEASE(265, 1, 3),
+    RELEASE(305, 5, 2),
+};
+
+static const key_event_t burst[] = {
+    PRESS(5, 3, 3), /* D */
+    RELEASE(9, 3, 3),
+    PRESS(13, 3, 3),
+    RELEASE(17, 3, 3),
+    PRESS(21, 3, 3),
+    RELEASE(25, 3, 3),
+    PRESS(29, 3, 3),
+    RELEASE(33, 3, 3),
+};
+
+static const key_event_t chatter[] = {
+    PRESS(5, 9, 2), /* U */
+    CHATTER(6, 9, 2, false),
+    CHATTER(7, 9, 2, true),
+    CHATTER(9, 9, 2, false),
+    CHATTER(10, 9, 2, true),
+    RELEASE(80, 9, 2),
+    CHATTER(81, 9, 2, true),
+    CHATTER(82, 9, 2, false),
+    CHATTER(84, 9, 2, true),
+    CHATTER(85, 9, 2, false),
+};
+
+static const timeline_t timelines[] = {
+    { .name = "idle", .events = NULL, .event_count = 0, .scan_count = 1000 },
+    TIMELINE("tap", tap, 200),
+    TIMELINE("chord", chord, 300),
+    TIMELINE("typing", typing, 400),
+    TIMELINE("burst", burst, 200),
+    TIMELINE("chatter", chatter, 200),
+};
+
+static uint8_t buffer[COLUMN_COUNT];
+static uint8_t debounced[COLUMN_COUNT];
+static uint8_t shipped[REPORT_INPUT_SIZE];
+static uint8_t key_byte[COLUMN_COUNT][ROW_COUNT];
+static uint8_t key_mask[COLUMN_COUNT][ROW_COUNT];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* One iteration of the main() loop body, returns the time spent building the report */
+static uint64_t scan_once(void) {
+    matrix_scan(buffer);
+    debounce_update(buffer, debounced);
+    uint64_t start = now_ns();
+    report_update(debounced, 0);
+    return now_ns() - start;
+}
+
+/* What an IN token does: take the oldest queued report */
+static bool poll(void) {
+    if (!report_queue_length()) {
+        return false;
+    }
+    const report_slot_t *slot = report_queue_front();
+    for (uint8_t i = 0; i < REPORT_INPUT_SIZE; ++i) {
+        shipped[i] = slot->data[i];
+    }
+    report_queue_pop();
+    return true;
+}
+
+static void settle(void) {
+    for (uint16_t n = 0; n < PROBE_LIMIT; ++n) {
+        scan_once();
+        poll();
+    }
+}
+
+/* Settle and return the first report bit that moved away from before[] */
+static bool settle_probe(const uint8_t before[], uint8_t *byte, uint8_t *mask) {
+    bool found = false;
+    for (uint16_t n = 0; n < PROBE_LIMIT; ++n) {
+        scan_once();
+        if (!poll() || found) {
+            continue;
+        }
+        for (uint8_t k = 0; k < REPORT_INPUT_SIZE; ++k) {
+            if (before[k] != shipped[k]) {
+                *byte = k;
+                *mask = before[k] ^ shipped[k];
+                found = true;
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+/*
+** Learn which report bit every key maps to by pressing it alone. A tap-hold
+** key only shows up once it is released, so the release is watched as well.
+*/
+static void probe_keys(void) {
+    for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+        for (uint8_t j = 0; j < ROW_COUNT; ++j) {
+            uint8_t before[REPORT_INPUT_SIZE];
+            for (uint8_t k = 0; k < REPORT_INPUT_SIZE; ++k) {
+                before[k] = shipped[k];
+            }
+            key_byte[i][j] = 0;
+            key_mask[i][j] = 0;
+            host_port_set_key(i, j, true);
+            bool found = settle_probe(before, &key_byte[i][j], &key_mask[i][j]);
+            host_port_set_key(i, j, false);
+            if (found) {
+                settle();
+            } else {
+                settle_probe(before, &key_byte[i][j], &key_mask[i][j]);
+            }
+        }
+    }
+}
+
+typedef struct {
+    key_event_t event;
+    uint16_t ready_scan;
+    uint32_t ready_report; /* sequence number of the queued report */
+    bool ready;
+} pending_t;
+
+typedef struct {
+    uint64_t scans;
+    uint64_t ns_total;
+    uint64_t ns_max;
+    uint64_t ns_report;
+    uint32_t delivered;
+    uint32_t lost;
+    uint32_t spurious;
+    uint32_t drops;
+    uint32_t ready_sum, ready_min, ready_max;
+    uint32_t ship_sum, ship_min, ship_max;
+} stats_t;
+
+static bool report_has(const uint8_t report[], const key_event_t *e) {
+    bool set = report[key_byte[e->column][e->row]] & key_mask[e->column][e->row];
+    return set == e->pressed;
+}
+
+/* Mark the oldest unresolved event of every key that a queued report reflects */
+static uint8_t resolve_ready(pending_t pending[], uint8_t count, uint16_t scan, const uint8_t report[], uint32_t sequence) {
+    uint8_t resolved = 0;
+    for (uint8_t i = 0; i < count; ++i) {
+        if (pending[i].ready) {
+            continue;
+        }
+        bool blocked = false;
+        for (uint8_t k = 0; k < i; ++k) {
+            if (!pending[k].ready
+                && pending[k].event.column == pending[i].event.column
+                && pending[k].event.row == pending[i].event.row) {
+                blocked = true;
+                break;
+            }
+        }
+        if (!blocked && report_has(report, &pending[i].event)) {
+            pending[i].ready = true;
+            pending[i].ready_scan = scan;
+            pending[i].ready_report = sequence;
+            ++resolved;
+        }
+    }
+    return resolved;
+}
+
+static uint8_t resolve_shipped(pending_t pending[], uint8_t count, uint16_t scan, uint32_t sequence, stats_t *stats) {
+    uint8_t kept = 0;
+    for (uint8_t i = 0; i < count; ++i) {
+        if (!pending[i].ready || pending[i].ready_report != sequence) {
+            pending[kept++] = pending[i];
+            continue;
+        }
+        uint32_t ready = pending[i].ready_scan - pending[i].event.scan + 1;
+        uint32_t ship = scan - pending[i].event.scan + 1;
+        stats->delivered += 1;
+        stats->ready_sum += ready;
+        stats->ship_sum += ship;
+        if (ready < stats->ready_min) stats->ready_min = ready;
+        if (ready > stats->ready_max) stats->ready_max = ready;
+        if (ship < stats->ship_min) stats->ship_min = ship;
+        if (ship > stats->ship_max) stats->ship_max = ship;
+    }
+    return kept;
+}
+
+static void run(const timeline_t *t, stats_t *stats) {
+    pending_t pending[PENDING_MAX];
+    uint8_t pending_count = 0;
+    uint16_t next = 0;
+    uint16_t total = t->scan_count + PROBE_LIMIT;
+    uint8_t head = report_queue_head;
+    uint16_t drops = report_queue_drops;
+    uint32_t pushed = 0;
+    uint32_t popped = 0;
+
+    for (uint16_t scan = 0; scan < total; ++scan) {
+        while (next < t->event_count && t->events[next].scan == scan) {
+            const key_event_t *e = &t->events[next++];
+            host_port_set_key(e->column, e->row, e->pressed);
+            if (!e->bounce && pending_count < PENDING_MAX) {
+                pending[pending_count++] = (pending_t){ .event = *e, .ready = false };
+            }
+        }
+
+        uint64_t start = now_ns();
+        stats->ns_report += scan_once();
+        uint64_t elapsed = now_ns() - start;
+        stats->scans += 1;
+        stats->ns_total += elapsed;
+        if (elapsed > stats->ns_max) {
+            stats->ns_max = elapsed;
+        }
+
+        for (; head != report_queue_head; ++head, ++pushed) {
+            const uint8_t *report = report_queue[head & (REPORT_QUEUE_DEPTH - 1)].data;
+            if (resolve_ready(pending, pending_count, scan, report, pushed) == 0) {
+                stats->spurious += 1;
+            }
+        }
+        if (scan % POLL_INTERVAL == POLL_INTERVAL - 1 && poll()) {
+            pending_count = resolve_shipped(pending, pending_count, scan, popped++, stats);
+        }
+    }
+    stats->lost += pending_count;
+    stats->drops += (uint16_t)(report_queue_drops - drops);
+}
+
+int main(void) {
+    host_port_reset();
+    matrix_init();
+    keymap_init();
+    probe_keys();
+
+    printf("%-8s %8s %10s %10s %10s %6s %6s %8s %6s %24s %24s\n",
+        "timeline", "scans", "ns/scan", "max ns", "report ns", "keys", "lost", "spurious", "drops",
+        "scans to ready min/avg/max", "scans to ship min/avg/max");
+    for (uint8_t i = 0; i < sizeof(timelines) / sizeof(timelines[0]); ++i) {
+        stats_t stats = {
+            .ready_min = UINT32_MAX,
+            .ship_min = UINT32_MAX,
+        };
+        for (uint16_t r = 0; r < REPEAT; ++r) {
+            run(&timelines[i], &stats);
+        }
+        char ready[32] = "-";
+        char ship[32] = "-";
+        if (stats.delivered) {
+            snprintf(ready, sizeof(ready), "%u/%.1f/%u",
+                stats.ready_min, (double)stats.ready_sum / stats.delivered, stats.ready_max);
+            snprintf(ship, sizeof(ship), "%u/%.1f/%u",
+                stats.ship_min, (double)stats.ship_sum / stats.delivered, stats.ship_max);
+        }
+        printf("%-8s %8llu %10.1f %10llu %10.1f %6u %6u %8u %6u %24s %24s\n",
+            timelines[i].name,
+            (unsigned long long)(stats.scans / REPEAT),
+            (double)stats.ns_total / stats.scans,
+            (unsigned long long)stats.ns_max,
+            (double)stats.ns_report / stats.scans,
+            stats.delivered / REPEAT,
+            stats.lost / REPEAT,
+            stats.spurious / REPEAT,
+            stats.drops / REPEAT,
+            ready, ship);
+    }
+    return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef HOST_COMPAT_H
+#define HOST_COMPAT_H
+
+/*
+** Host toolchains before GCC 13 accept -std=c2x but lack the C23 keywords
+** the firmware relies on.
+*/
+#if __STDC_VERSION__ < 202311L
+#include <stdbool.h>
+#define static_assert(...) _Static_assert(__VA_ARGS__)
+#endif
+
+#endif
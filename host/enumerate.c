@@ -0,0 +1,631 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include "port.h"
+#include "usbctl.h"
+#include "../usb.h"
+#include "../report.h"
+#include "../keymap.h"
+#include "../raw.h"
+#include "../trace.h"
+#include "../log.h"
+#include "../matrix.h"
+#include "../scheduler.h"
+#include "../usb_hid_keys.h"
+
+/*
+** Enumeration tests of usb.c against the controller model in usbctl.c.
+**
+** Walks the host's side of enumeration, checks what comes back against the
+** descriptors' own length fields, then times a batch of enumerations and the
+** path from a queued report to the IN token that carries it.
+*/
+
+#define REPEAT 1000
+
+/* Scheduler stand-in, time advances one frame per SOF */
+volatile uint16_t scheduler_missed = 0;
+
+void scheduler_sof(void) {
+}
+
+uint32_t scheduler_timestamp(void) {
+    return host_usb_stats.frames * 1000UL * SCHEDULER_COUNTS_PER_US;
+}
+
+uint32_t scheduler_tick_timestamp(void) {
+    return scheduler_timestamp();
+}
+
+static unsigned failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+        ++failures; \
+    } \
+} while (false)
+
+#define SETUP(TYPE, REQUEST, VALUE, INDEX, LENGTH) { \
+    TYPE, REQUEST, (VALUE) & 0xFF, (VALUE) >> 8, (INDEX) & 0xFF, (INDEX) >> 8, (LENGTH) & 0xFF, (LENGTH) >> 8 }
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int control(uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint16_t length, uint8_t *data) {
+    const uint8_t setup[8] = SETUP(type, request, value, index, length);
+    return host_usb_control(setup, data, length);
+}
+
+static void attach(void) {
+    host_usb_power_on();
+    UDIEN = _BV(EORSTE) | _BV(SOFE) | _BV(SUSPE); /* as usb_init() */
+    host_usb_bus_reset();
+}
+
+/* What a typical host does between reset and the first interrupt IN token */
+static bool enumerate(void) {
+    uint8_t data[256];
+    bool ok = true;
+    ok &= control(0x80, GET_DESCRIPTOR, DEVICE << 8, 0, 64, data) == sizeof(device_descriptor_t);
+    host_usb_bus_reset();
+    ok &= control(0x00, SET_ADDRESS, 5, 0, 0, NULL) == 0;
+    ok &= control(0x80, GET_DESCRIPTOR, DEVICE << 8, 0, sizeof(device_descriptor_t), data) == sizeof(device_descriptor_t);
+    ok &= control(0x80, GET_DESCRIPTOR, CONFIGURATION << 8, 0, 9, data) == 9;
+    uint16_t total = data[2] | data[3] << 8;
+    ok &= control(0x80, GET_DESCRIPTOR, CONFIGURATION << 8, 0, 255, data) == total;
+    ok &= control(0x00, SET_CONFIGURATION, 1, 0, 0, NULL) == 0;
+    ok &= control(0x21, SET_IDLE, 0, INTERFACE_KEYBOARD, 0, NULL) == 0;
+    ok &= control(0x81, GET_DESCRIPTOR, REPORT << 8, INTERFACE_KEYBOARD, 255, data) > 0;
+    ok &= control(0x21, SET_IDLE, 0, INTERFACE_RAW, 0, NULL) == 0;
+    ok &= control(0x81, GET_DESCRIPTOR, REPORT << 8, INTERFACE_RAW, 255, data) > 0;
+    return ok;
+}
+
+static void test_descriptors(void) {
+    uint8_t data[256];
+
+    attach();
+    int length = control(0x80, GET_DESCRIPTOR, DEVICE << 8, 0, 64, data);
+    CHECK(length == sizeof(device_descriptor_t));
+    CHECK(data[0] == length && data[1] == DEVICE);
+    CHECK(data[7] == 64);
+
+    /* Short read, the host may ask for less than the descriptor */
+    CHECK(control(0x80, GET_DESCRIPTOR, DEVICE << 8, 0, 8, data) == 8);
+
+    CHECK(control(0x00, SET_ADDRESS, 5, 0, 0, NULL) == 0);
+    CHECK(UDADDR == (0x80 | 5));
+
+    CHECK(control(0x80, GET_DESCRIPTOR, CONFIGURATION << 8, 0, 9, data) == 9);
+    uint16_t total = data[2] | data[3] << 8;
+    uint8_t interfaces = data[4];
+    CHECK(total > 64); /* takes more than one EP0 packet */
+    CHECK(control(0x80, GET_DESCRIPTOR, CONFIGURATION << 8, 0, 255, data) == total);
+    CHECK(control(0x80, GET_DESCRIPTOR, CONFIGURATION << 8, 0, 64, data) == 64);
+    CHECK(control(0x80, GET_DESCRIPTOR, CONFIGURATION << 8, 0, 255, data) == total);
+
+    /* Walk the set, every length must add up and every report descriptor must match its HID descriptor */
+    uint8_t seen = 0;
+    uint8_t interface = 0;
+    uint16_t offset = 0;
+    while (offset < total) {
+        uint8_t *d = data + offset;
+        CHECK(d[0] > 0);
+        if (d[0] == 0) {
+            break;
+        }
+        if (d[1] == INTERFACE) {
+            interface = d[2];
+            ++seen;
+        }
+        if (d[1] == HID) {
+            uint8_t report[256];
+            uint16_t expected = d[7] | d[8] << 8;
+            CHECK(control(0x81, GET_DESCRIPTOR, REPORT << 8, interface, 255, report) == expected);
+            CHECK(control(0x81, GET_DESCRIPTOR, HID << 8, interface, 255, report) == d[0]);
+            CHECK(memcmp(report, d, d[0]) == 0);
+        }
+        offset += d[0];
+    }
+    CHECK(offset == total);
+    CHECK(seen == interfaces);
+
+    CHECK(control(0x80, GET_DESCRIPTOR, STRING << 8, 0, 255, data) == HOST_USB_STALL);
+    CHECK(control(0x00, SET_CONFIGURATION, 1, 0, 0, NULL) == 0);
+    CHECK(control(0x80, GET_CONFIGURATION, 0, 0, 1, data) == 1 && data[0] == 1);
+}
+
+static void test_requests(void) {
+    uint8_t data[64];
+
+    attach();
+    CHECK(enumerate());
+
+    CHECK(control(0x80, GET_STATUS, 0, 0, 2, data) == 2 && data[0] == 0x00);
+    CHECK(control(0x00, SET_FEATURE, DEVICE_REMOTE_WAKEUP, 0, 0, NULL) == 0);
+    CHECK(control(0x80, GET_STATUS, 0, 0, 2, data) == 2 && data[0] == 0x02);
+    CHECK(control(0x00, CLEAR_FEATURE, DEVICE_REMOTE_WAKEUP, 0, 0, NULL) == 0);
+    CHECK(control(0x80, GET_STATUS, 0, 0, 2, data) == 2 && data[0] == 0x00);
+
+    CHECK(control(0xA1, GET_REPORT, 0x01 << 8 | REPORT_ID_KEYBOARD, INTERFACE_KEYBOARD, 64, data) == REPORT_INPUT_SIZE);
+    CHECK(data[0] == REPORT_ID_KEYBOARD);
+    CHECK(control(0xA1, GET_REPORT, 0x01 << 8, INTERFACE_RAW, 64, data) == HOST_USB_STALL);
+    CHECK(control(0xA1, GET_IDLE, 0, INTERFACE_KEYBOARD, 1, data) == 1 && data[0] == 0);
+    CHECK(control(0x21, SET_PROTOCOL, REPORT_PROTOCOL_BOOT, INTERFACE_KEYBOARD, 0, NULL) == 0);
+    CHECK(control(0xA1, GET_PROTOCOL, 0, INTERFACE_KEYBOARD, 1, data) == 1 && data[0] == REPORT_PROTOCOL_BOOT);
+    CHECK(control(0x21, SET_PROTOCOL, REPORT_PROTOCOL_REPORT, INTERFACE_KEYBOARD, 0, NULL) == 0);
+
+    data[0] = 0x01; /* Num Lock LED */
+    CHECK(control(0x21, SET_REPORT, 0x02 << 8, INTERFACE_KEYBOARD, 1, data) == 1);
+
+    /* A SETUP in the middle of a data stage starts over */
+    const uint8_t setup[8] = SETUP(0x80, GET_DESCRIPTOR, CONFIGURATION << 8, 0, 255);
+    uint8_t packet[64];
+    CHECK(host_usb_setup(setup) == 0);
+    CHECK(host_usb_in(0, packet) == 64);
+    CHECK(control(0x80, GET_DESCRIPTOR, DEVICE << 8, 0, 64, data) == sizeof(device_descriptor_t));
+    CHECK(host_usb_in(0, packet) == HOST_USB_NAK);
+}
+
+/* Frames from queueing a report to the IN token that carries it */
+static void test_report_timing(void) {
+    uint8_t packet[64];
+    uint8_t state[COLUMN_COUNT] = { 0, };
+
+    attach();
+    CHECK(enumerate());
+    while (host_usb_in(KEYBOARD_IN_ENDPOINT, packet) >= 0) {
+    }
+
+    uint32_t frames_max = 0;
+    for (uint16_t r = 0; r < 64; ++r) {
+        state[2] ^= _BV(2);
+        report_update(state, scheduler_timestamp());
+        usb_report_ready();
+        uint32_t start = host_usb_stats.frames;
+        int length;
+        while ((length = host_usb_in(KEYBOARD_IN_ENDPOINT, packet)) < 0 && host_usb_stats.frames - start < 16) {
+            host_usb_sof();
+        }
+        CHECK(length == REPORT_INPUT_SIZE);
+        uint32_t frames = host_usb_stats.frames - start;
+        if (frames > frames_max) {
+            frames_max = frames;
+        }
+    }
+    printf("report to IN token: max %u frames (%s)\n", frames_max,
+        USB_REPORT_SOF_GATED ? "SOF gated" : "TXINI");
+    CHECK(frames_max <= (USB_REPORT_SOF_GATED ? 1 : 0));
+}
+
+/* An idle period elapsing with reports still queued must not jump the queue */
+static void test_idle_order(void) {
+    uint8_t packet[64];
+    uint8_t current[64];
+    uint8_t state[COLUMN_COUNT] = { 0, };
+
+    attach();
+    CHECK(enumerate());
+    while (host_usb_in(KEYBOARD_IN_ENDPOINT, packet) >= 0) {
+    }
+
+    state[2] = _BV(2);
+    report_update(state, scheduler_timestamp());
+    state[2] |= _BV(1);
+    report_update(state, scheduler_timestamp());
+    CHECK(report_queue_length() == 2);
+    CHECK(control(0xA1, GET_REPORT, 0x01 << 8 | REPORT_ID_KEYBOARD, INTERFACE_KEYBOARD, 64, current) == REPORT_INPUT_SIZE);
+
+    /* 4 ms idle period, the first two frames are queued reports, not repeats */
+    CHECK(control(0x21, SET_IDLE, 1 << 8, INTERFACE_KEYBOARD, 0, NULL) == 0);
+    for (uint8_t i = 0; i < 8; ++i) {
+        host_usb_sof();
+    }
+    usb_report_ready();
+    if (USB_REPORT_SOF_GATED) {
+        host_usb_sof();
+    }
+    CHECK(host_usb_in(KEYBOARD_IN_ENDPOINT, packet) == REPORT_INPUT_SIZE);
+    CHECK(memcmp(packet, current, REPORT_INPUT_SIZE) != 0);
+    if (USB_REPORT_SOF_GATED) {
+        host_usb_sof();
+    }
+    CHECK(host_usb_in(KEYBOARD_IN_ENDPOINT, packet) == REPORT_INPUT_SIZE);
+    CHECK(memcmp(packet, current, REPORT_INPUT_SIZE) == 0);
+
+    /* With the queue empty the repeat is the last report sent */
+    for (uint8_t i = 0; i < 4; ++i) {
+        host_usb_sof();
+    }
+    CHECK(host_usb_in(KEYBOARD_IN_ENDPOINT, packet) == REPORT_INPUT_SIZE);
+    CHECK(memcmp(packet, current, REPORT_INPUT_SIZE) == 0);
+
+    CHECK(control(0x21, SET_IDLE, 0, INTERFACE_KEYBOARD, 0, NULL) == 0);
+    state[2] = 0x00;
+    report_update(state, scheduler_timestamp());
+    usb_report_ready();
+    host_usb_sof();
+    while (host_usb_in(KEYBOARD_IN_ENDPOINT, packet) >= 0) {
+    }
+}
+
+/* SET_PROTOCOL applies to queued reports, GET_REPORT and idle repeats without a scan in between */
+static void test_protocol(void) {
+    uint8_t packet[64];
+    uint8_t data[64];
+    uint8_t state[COLUMN_COUNT] = { 0, };
+
+    attach();
+    CHECK(enumerate());
+    while (host_usb_in(KEYBOARD_IN_ENDPOINT, packet) >= 0) {
+    }
+
+    /* Queued in report protocol, shipped after the switch to boot */
+    state[2] = _BV(2);
+    report_update(state, scheduler_timestamp());
+    CHECK(control(0x21, SET_PROTOCOL, REPORT_PROTOCOL_BOOT, INTERFACE_KEYBOARD, 0, NULL) == 0);
+    usb_report_ready();
+    if (USB_REPORT_SOF_GATED) {
+        host_usb_sof();
+    }
+    CHECK(host_usb_in(KEYBOARD_IN_ENDPOINT, packet) == REPORT_BOOT_SIZE);
+    CHECK(packet[2] != KEY_NONE && packet[3] == KEY_NONE);
+    CHECK(control(0xA1, GET_REPORT, 0x01 << 8, INTERFACE_KEYBOARD, 64, data) == REPORT_BOOT_SIZE);
+    CHECK(memcmp(data, packet, REPORT_BOOT_SIZE) == 0);
+    CHECK(control(0x21, SET_IDLE, 1 << 8, INTERFACE_KEYBOARD, 0, NULL) == 0);
+    for (uint8_t i = 0; i < 4; ++i) {
+        host_usb_sof();
+    }
+    CHECK(host_usb_in(KEYBOARD_IN_ENDPOINT, data) == REPORT_BOOT_SIZE);
+    CHECK(memcmp(data, packet, REPORT_BOOT_SIZE) == 0);
+
+    /* And back, the boot keycode lands on its bitmap bit */
+    uint8_t keycode = packet[2];
+    CHECK(control(0x21, SET_PROTOCOL, REPORT_PROTOCOL_REPORT, INTERFACE_KEYBOARD, 0, NULL) == 0);
+    CHECK(control(0xA1, GET_REPORT, 0x01 << 8 | REPORT_ID_KEYBOARD, INTERFACE_KEYBOARD, 64, data) == REPORT_INPUT_SIZE);
+    CHECK(data[0] == REPORT_ID_KEYBOARD && data[2 + keycode / 8] == _BV(keycode % 8));
+
+    CHECK(control(0x21, SET_IDLE, 0, INTERFACE_KEYBOARD, 0, NULL) == 0);
+    state[2] = 0x00;
+    report_update(state, scheduler_timestamp());
+    usb_report_ready();
+    host_usb_sof();
+    while (host_usb_in(KEYBOARD_IN_ENDPOINT, packet) >= 0) {
+    }
+}
+
+/* Raw packets move on their endpoint interrupts, no SOF in between */
+static void test_raw(void) {
+    uint8_t packet[64] = { RAW_COMMAND_STATS, };
+
+    attach();
+    CHECK(enumerate());
+    uint32_t frames = host_usb_stats.frames;
+    CHECK(host_usb_out(RAW_OUT_ENDPOINT, packet, 1) == 1);
+    CHECK(raw_rx_full);
+    /* The bank takes one more command, after that the host is held off */
+    packet[0] = 0x7E;
+    CHECK(host_usb_out(RAW_OUT_ENDPOINT, packet, 1) == 1);
+    CHECK(host_usb_out(RAW_OUT_ENDPOINT, packet, 1) == HOST_USB_NAK);
+#if LOG_ENABLE
+    uint16_t dropped = log_dropped;
+    log_dropped = 0x1234;
+#endif
+    raw_task();
+#if LOG_ENABLE
+    log_dropped = dropped;
+#endif
+    CHECK(host_usb_in(RAW_IN_ENDPOINT, packet) == RAW_REPORT_SIZE);
+    CHECK(packet[0] == RAW_COMMAND_STATS);
+    /* log_dropped, then the link counters that stay zero without a link */
+#if LOG_ENABLE
+    CHECK(packet[22] == 0x34 && packet[23] == 0x12);
+#else
+    CHECK(packet[22] == 0 && packet[23] == 0);
+#endif
+    for (uint8_t i = 24; i < 30; ++i) {
+        CHECK(packet[i] == 0);
+    }
+    CHECK(host_usb_in(RAW_IN_ENDPOINT, packet) == HOST_USB_NAK);
+    raw_task();
+    CHECK(host_usb_in(RAW_IN_ENDPOINT, packet) == RAW_REPORT_SIZE);
+    CHECK(packet[0] == RAW_COMMAND_UNKNOWN);
+    CHECK(host_usb_stats.frames == frames);
+}
+
+#if TRACE_DEPTH
+/* One RAW_COMMAND_TRACE round trip, returns the event count */
+static uint8_t trace_query(uint8_t packet[64]) {
+    packet[0] = RAW_COMMAND_TRACE;
+    CHECK(host_usb_out(RAW_OUT_ENDPOINT, packet, 1) == 1);
+    raw_task();
+    CHECK(host_usb_in(RAW_IN_ENDPOINT, packet) == RAW_REPORT_SIZE);
+    CHECK(packet[0] == RAW_COMMAND_TRACE);
+    return packet[1];
+}
+
+/* A press followed from the matrix into the EP1 bank, then a flooded ring */
+static void test_trace(void) {
+    uint8_t packet[64];
+    uint8_t state[COLUMN_COUNT] = { 0, };
+
+    attach();
+    CHECK(enumerate());
+    while (host_usb_in(KEYBOARD_IN_ENDPOINT, packet) >= 0) {
+    }
+    while (trace_query(packet)) {
+    }
+    uint16_t lost = packet[2] | packet[3] << 8;
+
+    host_usb_sof();
+    uint16_t frame = UDFNUM;
+    state[2] = _BV(2);
+    trace_scan(state);
+    uint8_t sequence = report_queue_head;
+    report_update(state, scheduler_timestamp());
+    CHECK(report_queue_head != sequence);
+    trace_report(TRACE_QUEUED, sequence);
+    usb_report_ready();
+    if (USB_REPORT_SOF_GATED) {
+        host_usb_sof();
+    }
+    CHECK(host_usb_in(KEYBOARD_IN_ENDPOINT, packet) == REPORT_INPUT_SIZE);
+
+    CHECK(trace_query(packet) == 3);
+    const uint8_t expected[3][2] = {
+        { TRACE_PRESS, 2 << 3 | 2 }, { TRACE_QUEUED, sequence }, { TRACE_SHIPPED, sequence },
+    };
+    for (uint8_t i = 0; i < 3; ++i) {
+        const uint8_t *event = packet + 4 + i * TRACE_EVENT_SIZE;
+        CHECK((event[0] | event[1] << 8) == frame + (i == 2 && USB_REPORT_SOF_GATED));
+        CHECK(event[4] == expected[i][0] && event[5] == expected[i][1]);
+    }
+
+    /* Overflow drops the newest events and counts them */
+    for (uint16_t i = 0; i < TRACE_DEPTH + 3; ++i) {
+        state[2] ^= _BV(2);
+        trace_scan(state);
+    }
+    uint16_t drained = 0;
+    uint8_t count;
+    while ((count = trace_query(packet))) {
+        drained += count;
+    }
+    CHECK(drained == TRACE_DEPTH);
+    CHECK((packet[2] | packet[3] << 8) == lost + 3);
+    state[2] = 0x00;
+    trace_scan(state);
+    report_update(state, scheduler_timestamp());
+}
+#endif
+
+#if LOG_ENABLE
+/* USART1 stand-in, collects what the UDRE interrupt sends */
+volatile uint8_t UCSR1A, UCSR1B, UCSR1C;
+volatile uint16_t UBRR1;
+
+void USART1_UDRE_vect(void);
+
+static char udr1[LOG_BUFFER_SIZE];
+static uint8_t udr1_length;
+
+volatile uint8_t *host_udr1(void) {
+    return (volatile uint8_t *)&udr1[udr1_length++ % sizeof(udr1)];
+}
+
+/* What reaches the wire, with the main loop running log_task() between interrupts */
+static const char *wire(void) {
+    udr1_length = 0;
+    for (;;) {
+        while (UCSR1B & _BV(UDRIE1)) {
+            USART1_UDRE_vect();
+        }
+        uint8_t length = udr1_length;
+        log_task();
+        if (!(UCSR1B & _BV(UDRIE1)) && udr1_length == length) {
+            break;
+        }
+    }
+    udr1[udr1_length % sizeof(udr1)] = '\0';
+    return udr1;
+}
+
+/* The USB interrupts only queue their lines, formatting waits for log_task() */
+static void test_log(void) {
+    uint8_t buffer[COLUMN_COUNT];
+
+    log_init();
+    attach();
+    wire();
+    host_usb_bus_reset();
+    CHECK(!(UCSR1B & _BV(UDRIE1)));
+    CHECK(strcmp(wire(), "usb: reset\n") == 0);
+    CHECK(enumerate());
+    CHECK(strstr(wire(), "usb: configuration 1\n") != NULL);
+
+    LOG("%d %u", -5, 65535);
+    LOG("%lx %ld%%", 0xDEADBEEFUL, -100000L);
+    LOG("%c", 'k');
+    CHECK(strcmp(wire(), "-5 65535\n" "deadbeef -100000%\n" "k\n") == 0);
+
+    /* A full queue drops the newest line and keeps the rest in order */
+    char expected[LOG_QUEUE_DEPTH * 4 + 1] = "";
+    uint16_t dropped = log_dropped;
+    for (uint8_t i = 0; i <= LOG_QUEUE_DEPTH; ++i) {
+        LOG("%u", i);
+        if (i < LOG_QUEUE_DEPTH) {
+            sprintf(expected + strlen(expected), "%u\n", i);
+        }
+    }
+    CHECK(log_dropped == dropped + 1);
+    CHECK(strcmp(wire(), expected) == 0);
+
+    /* Row 4 is on PD3, TXD1, and never shows up in a scan */
+    host_port_set_key(2, 3, true);
+    host_port_set_key(2, 2, true);
+    matrix_scan(buffer);
+    CHECK(buffer[2] == _BV(2));
+    host_port_set_key(2, 3, false);
+    host_port_set_key(2, 2, false);
+}
+#endif
+
+static void test_suspend(void) {
+    uint8_t data[2];
+
+    attach();
+    CHECK(enumerate());
+    host_usb_suspend();
+    CHECK(usb_suspended);
+    CHECK(USBCON & _BV(FRZCLK));
+    CHECK(!(PLLCSR & _BV(PLLE)));
+
+    /* The interrupt only starts the PLL, usb_task() unfreezes once it locked */
+    PLLCSR &= ~_BV(PLOCK);
+    host_usb_resume();
+    CHECK(PLLCSR & _BV(PLLE));
+    CHECK(usb_suspended);
+    usb_task();
+    CHECK(USBCON & _BV(FRZCLK));
+    PLLCSR |= _BV(PLOCK);
+    usb_task();
+    CHECK(!usb_suspended);
+    CHECK(!(USBCON & _BV(FRZCLK)));
+    CHECK(control(0x80, GET_STATUS, 0, 0, 2, data) == 2);
+}
+
+/* Vendor keymap requests, then the EEPROM write-back behind them */
+static void test_keymap(void) {
+    uint8_t data[1];
+
+    attach();
+    CHECK(enumerate());
+    CHECK(control(0xC0, KEYMAP_REQUEST_GET_KEY, 0 << 8 | 1, 3, 1, data) == 1);
+    CHECK(data[0] == KEY_A);
+    CHECK(control(0xC0, KEYMAP_REQUEST_GET_KEY, LAYER_COUNT << 8 | 1, 3, 1, data) == HOST_USB_STALL);
+    CHECK(control(0x40, KEYMAP_REQUEST_SET_KEY, 0 << 8 | COLUMN_COUNT, KEY_B << 8 | 3, 0, NULL) == HOST_USB_STALL);
+
+    /* A blank EEPROM gets the whole keymap, the magic byte last */
+    CHECK(control(0x40, KEYMAP_REQUEST_SET_KEY, 0 << 8 | 1, KEY_B << 8 | 3, 0, NULL) == 0);
+    CHECK(control(0xC0, KEYMAP_REQUEST_GET_KEY, 0 << 8 | 1, 3, 1, data) == 1);
+    CHECK(data[0] == KEY_B);
+    CHECK(keymap_press(1, 3) == KEY_B);
+    keymap_release(1, 3);
+    host_eeprom_writes = 0;
+    for (uint16_t i = 0; i < KEYMAP_PERSIST_MS / 4; ++i) {
+        keymap_task();
+    }
+    CHECK(host_eeprom_writes == 0); /* still batching */
+    for (uint16_t i = 0; i < 1000; ++i) {
+        keymap_task();
+    }
+    uint16_t formatted = host_eeprom_writes;
+    CHECK(formatted > 1);
+
+    /* Later changes write only the entries that differ, one byte each */
+    host_eeprom_writes = 0;
+    CHECK(control(0x40, KEYMAP_REQUEST_SET_KEY, 0 << 8 | 2, KEY_C << 8 | 3, 0, NULL) == 0);
+    CHECK(control(0x40, KEYMAP_REQUEST_SET_KEY, 1 << 8 | 2, KEY_D << 8 | 3, 0, NULL) == 0);
+    CHECK(control(0x40, KEYMAP_REQUEST_SET_KEY, 0 << 8 | 1, KEY_B << 8 | 3, 0, NULL) == 0);
+    for (uint16_t i = 0; i < 1000; ++i) {
+        keymap_task();
+    }
+    CHECK(host_eeprom_writes == 2);
+
+    /* Only KEYMAP_OVERRIDES entries can differ, the built-in keycode frees one */
+    CHECK(control(0xC0, KEYMAP_REQUEST_GET_FREE, 0, 0, 1, data) == 1);
+    CHECK(data[0] == KEYMAP_OVERRIDES - 3);
+    uint8_t taken = 3;
+    for (uint8_t column = 0; column < COLUMN_COUNT && taken < KEYMAP_OVERRIDES; ++column) {
+        for (uint8_t row = 0; row < ROW_COUNT && taken < KEYMAP_OVERRIDES; ++row) {
+            if (column != 1 && column != 2) {
+                CHECK(control(0x40, KEYMAP_REQUEST_SET_KEY, 1 << 8 | column, KEY_E << 8 | row, 0, NULL) == 0);
+                ++taken;
+            }
+        }
+    }
+    CHECK(control(0x40, KEYMAP_REQUEST_SET_KEY, 1 << 8 | 1, KEY_F << 8 | 0, 0, NULL) == HOST_USB_STALL);
+    CHECK(control(0xC0, KEYMAP_REQUEST_GET_FREE, 0, 0, 1, data) == 1 && data[0] == 0);
+    CHECK(control(0x40, KEYMAP_REQUEST_SET_KEY, 0 << 8 | 2, KEY_S << 8 | 3, 0, NULL) == 0);
+    CHECK(control(0x40, KEYMAP_REQUEST_SET_KEY, 1 << 8 | 1, KEY_F << 8 | 0, 0, NULL) == 0);
+    CHECK(control(0xC0, KEYMAP_REQUEST_GET_KEY, 1 << 8 | 1, 0, 1, data) == 1 && data[0] == KEY_F);
+    CHECK(control(0xC0, KEYMAP_REQUEST_GET_KEY, 0 << 8 | 2, 3, 1, data) == 1 && data[0] == KEY_S);
+    CHECK(control(0xC0, KEYMAP_REQUEST_GET_KEY, 1 << 8 | 2, 3, 1, data) == 1 && data[0] == KEY_D);
+    CHECK(control(0xC0, KEYMAP_REQUEST_GET_KEY, 1 << 8 | 0, 0, 1, data) == 1 && data[0] == KEY_E);
+    for (uint16_t i = 0; i < 1000; ++i) {
+        keymap_task();
+    }
+
+    /* Reboot from EEPROM, then back to the built-in keymap */
+    keymap_init();
+    CHECK(keymap_press(1, 3) == KEY_B);
+    keymap_release(1, 3);
+    CHECK(control(0xC0, KEYMAP_REQUEST_GET_KEY, 1 << 8 | 1, 0, 1, data) == 1 && data[0] == KEY_F);
+    CHECK(control(0xC0, KEYMAP_REQUEST_GET_KEY, 1 << 8 | 2, 3, 1, data) == 1 && data[0] == KEY_D);
+    CHECK(control(0xC0, KEYMAP_REQUEST_GET_FREE, 0, 0, 1, data) == 1 && data[0] == 0);
+    CHECK(control(0x40, KEYMAP_REQUEST_RESET_KEYS, 0, 0, 0, NULL) == 0);
+    CHECK(keymap_press(1, 3) == KEY_A);
+    keymap_release(1, 3);
+    host_eeprom_writes = 0;
+    for (uint16_t i = 0; i < 1000; ++i) {
+        keymap_task();
+    }
+    CHECK(host_eeprom_writes == KEYMAP_OVERRIDES);
+    keymap_init();
+    CHECK(keymap_press(1, 3) == KEY_A);
+    keymap_release(1, 3);
+}
+
+static void bench_enumeration(void) {
+    uint64_t total = 0;
+    uint64_t worst = 0;
+    uint32_t isr_calls = 0;
+    uint32_t tokens = 0;
+    for (uint16_t r = 0; r < REPEAT; ++r) {
+        uint64_t start = now_ns();
+        attach();
+        CHECK(enumerate());
+        uint64_t elapsed = now_ns() - start;
+        total += elapsed;
+        if (elapsed > worst) {
+            worst = elapsed;
+        }
+        isr_calls = host_usb_stats.isr_calls;
+        tokens = host_usb_stats.tokens;
+    }
+    printf("enumeration: %.1f ns avg, %llu ns max, %u interrupts, %u tokens\n",
+        (double)total / REPEAT, (unsigned long long)worst, isr_calls, tokens);
+}
+
+int main(void) {
+    host_port_reset();
+    matrix_init();
+    keymap_init();
+
+    test_descriptors();
+    test_requests();
+    test_report_timing();
+    test_idle_order();
+    test_protocol();
+    test_raw();
+#if TRACE_DEPTH
+    test_trace();
+#endif
+#if LOG_ENABLE
+    test_log();
+#endif
+    test_suspend();
+    test_keymap();
+    bench_enumeration();
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,280 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <avr/io.h>
+#include "port.h"
+#include "../link.h"
+#include "../matrix.h"
+#include "../idle.h"
+#include "../scheduler.h"
+
+/*
+** Link tests of link.c with USART1 looped back onto itself.
+**
+** The loopback stand-in moves every byte the UDRE interrupt writes into the
+** receive interrupt, optionally corrupting or dropping it on the way. One
+** wire() call models the time between two scans, which the static_assert in
+** link.h guarantees is enough for the largest frame.
+*/
+
+/* Scheduler stand-in for idle.c, the clock only moves when a test moves it */
+static uint32_t now = 0;
+static uint32_t tick = 0;
+
+uint32_t scheduler_timestamp(void) {
+    return now;
+}
+
+uint32_t scheduler_tick_timestamp(void) {
+    return tick;
+}
+
+volatile uint8_t UCSR1A, UCSR1B, UCSR1C;
+volatile uint16_t UBRR1;
+
+void USART1_RX_vect(void);
+void USART1_UDRE_vect(void);
+
+static uint8_t udr1;
+static bool udr1_touched;
+
+volatile uint8_t *host_udr1(void) {
+    udr1_touched = true;
+    return &udr1;
+}
+
+static unsigned failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+        ++failures; \
+    } \
+} while (false)
+
+#define WIRE_CLEAN 0xFFFF
+
+static uint32_t wire_bytes = 0;
+
+/* Deliver everything queued, flipping a bit of byte `corrupt` or dropping byte `drop` */
+static uint8_t wire(uint16_t corrupt, uint16_t drop) {
+    uint8_t sent = 0;
+    for (uint16_t n = 0; UCSR1B & _BV(UDRIE1); ++n) {
+        udr1_touched = false;
+        USART1_UDRE_vect();
+        if (!udr1_touched) {
+            continue;
+        }
+        ++sent;
+        ++wire_bytes;
+        if (n == drop) {
+            continue;
+        }
+        udr1 ^= n == corrupt ? 0x10 : 0x00;
+        USART1_RX_vect();
+    }
+    return sent;
+}
+
+static uint8_t local[COLUMN_COUNT];
+static uint8_t none[COLUMN_COUNT];
+
+static bool merged_equals(const uint8_t *merged, const uint8_t *expected) {
+    for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+        if (merged[i] != expected[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Scans until a refresh has gone out, so every test starts in sync */
+static void settle(void) {
+    for (uint16_t i = 0; i <= LINK_REFRESH; ++i) {
+        link_send(local);
+        wire(WIRE_CLEAN, WIRE_CLEAN);
+        link_merge(none);
+    }
+}
+
+/* A change sent on scan n is merged on scan n + 1, and only changed columns travel */
+static void test_delta(void) {
+    settle();
+    uint16_t frames = link_frames;
+    local[3] = _BV(2);
+    link_send(local);
+    CHECK(merged_equals(link_merge(none), none)); /* not before it was on the wire */
+    CHECK(wire(WIRE_CLEAN, WIRE_CLEAN) == LINK_HEADER_SIZE + 1 + 1);
+    CHECK(merged_equals(link_merge(none), local));
+    CHECK(link_frames == frames + 1);
+
+    /* Nothing changed, nothing sent */
+    link_send(local);
+    CHECK(wire(WIRE_CLEAN, WIRE_CLEAN) == 0);
+
+    local[3] = 0x00;
+    local[9] = _BV(0) | _BV(4);
+    local[13] = _BV(1);
+    link_send(local);
+    CHECK(wire(WIRE_CLEAN, WIRE_CLEAN) == LINK_HEADER_SIZE + 3 + 1);
+    CHECK(merged_equals(link_merge(none), local));
+
+    /* Remote keys add to the local ones */
+    uint8_t both[COLUMN_COUNT] = { 0, };
+    both[0] = _BV(1);
+    const uint8_t *merged = link_merge(both);
+    CHECK(merged[0] == _BV(1) && merged[9] == local[9] && merged[13] == local[13]);
+
+    for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+        local[i] = 0x00;
+    }
+    link_send(local);
+    wire(WIRE_CLEAN, WIRE_CLEAN);
+    CHECK(merged_equals(link_merge(none), none));
+}
+
+/*
+** A damaged byte anywhere loses the whole frame and a refresh repairs it. A
+** damaged column mask can make the receiver wait for bytes that never come,
+** which it gives up on after two scans without one.
+*/
+static void test_corrupt(void) {
+    settle();
+    for (uint8_t position = 0; position < LINK_HEADER_SIZE + 2 + 1; ++position) {
+        uint16_t errors = link_errors;
+        uint16_t frames = link_frames;
+        local[5] ^= _BV(3);
+        local[6] ^= _BV(0);
+        link_send(local);
+        wire(position, WIRE_CLEAN);
+        CHECK(!merged_equals(link_merge(none), local));
+        CHECK(link_frames == frames);
+        link_merge(none);
+        CHECK(position == 0 || link_errors == errors + 1); /* a lost sync is never seen */
+        settle();
+        CHECK(merged_equals(link_merge(none), local));
+    }
+}
+
+/* A lost frame shows up as a sequence gap */
+static void test_gap(void) {
+    settle();
+    uint16_t gaps = link_gaps;
+    local[1] ^= _BV(1);
+    link_send(local);
+    wire(WIRE_CLEAN, 0);
+    local[2] ^= _BV(2);
+    link_send(local);
+    wire(WIRE_CLEAN, WIRE_CLEAN);
+    CHECK(link_gaps == gaps + 1);
+    CHECK(link_merge(none)[1] != local[1]);
+    settle();
+    CHECK(merged_equals(link_merge(none), local));
+    CHECK(link_gaps == gaps + 1);
+}
+
+/* Remote keys are released once the other end goes quiet */
+static void test_timeout(void) {
+    settle();
+    local[4] = _BV(4);
+    link_send(local);
+    wire(WIRE_CLEAN, WIRE_CLEAN);
+    for (uint16_t i = 0; i < LINK_TIMEOUT; ++i) {
+        CHECK(merged_equals(link_merge(none), local));
+    }
+    CHECK(merged_equals(link_merge(none), none));
+    local[4] = 0x00;
+    settle();
+}
+
+/* Random typing with a damaged byte now and then always converges */
+static void test_random(void) {
+    srand(1);
+    uint16_t mismatched = 0;
+    for (uint16_t scan = 0; scan < 20000; ++scan) {
+        if (rand() % 8 == 0) {
+            local[rand() % COLUMN_COUNT] ^= _BV(rand() % ROW_COUNT);
+        }
+        link_send(local);
+        uint16_t damage = rand() % 512;
+        wire(damage < LINK_FRAME_MAX ? damage : WIRE_CLEAN, WIRE_CLEAN);
+        mismatched += !merged_equals(link_merge(none), local);
+    }
+    settle();
+    CHECK(merged_equals(link_merge(none), local));
+    printf("random: %u of 20000 scans out of sync, %u errors, %u gaps\n",
+        mismatched, link_errors, link_gaps);
+}
+
+/* Rows 3 and 4 carry the serial lines and never show up in a scan or the idle poll */
+static void test_rows(void) {
+    uint8_t buffer[COLUMN_COUNT];
+    host_port_reset();
+    matrix_init();
+    host_port_set_key(4, 2, true);
+    host_port_set_key(4, 3, true);
+    matrix_scan(buffer);
+    CHECK(merged_equals(buffer, none));
+    matrix_idle_enter();
+    CHECK(!matrix_idle_poll());
+    matrix_idle_exit();
+    host_port_set_key(4, 0, true);
+    matrix_scan(buffer);
+    CHECK(buffer[4] == _BV(0));
+    host_port_reset();
+}
+
+#if IDLE_SCANS
+/* Parks after IDLE_SCANS empty scans */
+static void park(void) {
+    for (uint16_t i = 0; i < IDLE_SCANS; ++i) {
+        CHECK(!idle_poll());
+        idle_update(none, none);
+    }
+    CHECK(idle_poll());
+}
+
+/* A press and a link frame both count as a wake and are both timed, each from where it was seen */
+static void test_idle(void) {
+    host_port_reset();
+    matrix_init();
+    uint16_t wakes = idle_wakes;
+
+    park();
+    tick = 1000 * SCHEDULER_COUNTS_PER_US;
+    now = tick + 30 * SCHEDULER_COUNTS_PER_US;
+    host_port_set_key(7, 1, true);
+    CHECK(!idle_poll());
+    CHECK(idle_wakes == wakes + 1);
+    CHECK(idle_wake_us == 30);
+    host_port_set_key(7, 1, false);
+
+    park();
+    idle_wake();
+    now += 700 * SCHEDULER_COUNTS_PER_US;
+    CHECK(!idle_poll());
+    CHECK(idle_wakes == wakes + 2);
+    CHECK(idle_wake_us == 700);
+    CHECK(idle_wake_max_us >= 700);
+    host_port_reset();
+}
+#endif
+
+int main(void) {
+    test_rows();
+#if IDLE_SCANS
+    test_idle();
+#endif
+    link_init();
+
+    test_delta();
+    test_corrupt();
+    test_gap();
+    test_timeout();
+    test_random();
+
+    printf("%u frames, %lu bytes, frame max %u bytes at %lu baud\n",
+        link_frames, (unsigned long)wire_bytes, LINK_FRAME_MAX, (unsigned long)USART_BAUDRATE);
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}
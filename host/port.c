@@ -0,0 +1,88 @@
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include "port.h"
+
+volatile uint8_t PORTB, DDRB;
+volatile uint8_t PORTC, DDRC;
+volatile uint8_t PORTD, DDRD;
+volatile uint8_t PORTF, DDRF;
+volatile uint8_t TCCR1A, TCCR1B;
+volatile uint16_t TCNT1;
+uint16_t host_eeprom_writes;
+
+/* Physical wiring of the PCB, see matrix_init() */
+static volatile uint8_t * const column_port[COLUMN_COUNT] = {
+    &PORTF, &PORTF, &PORTF, &PORTF, &PORTF, &PORTF,
+    &PORTB, &PORTB, &PORTB, &PORTB, &PORTB, &PORTB, &PORTB, &PORTB,
+};
+static volatile uint8_t * const column_ddr[COLUMN_COUNT] = {
+    &DDRF, &DDRF, &DDRF, &DDRF, &DDRF, &DDRF,
+    &DDRB, &DDRB, &DDRB, &DDRB, &DDRB, &DDRB, &DDRB, &DDRB,
+};
+static const uint8_t column_pin[COLUMN_COUNT] = {
+    7, 6, 5, 4, 1, 0,
+    0, 1, 2, 3, 4, 5, 6, 7,
+};
+
+static uint8_t switches[COLUMN_COUNT];
+
+void host_port_reset(void) {
+    PORTB = DDRB = 0x00;
+    PORTC = DDRC = 0x00;
+    PORTD = DDRD = 0x00;
+    PORTF = DDRF = 0x00;
+    for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+        switches[i] = 0x00;
+    }
+}
+
+void host_port_set_key(uint8_t column, uint8_t row, bool pressed) {
+    if (pressed) {
+        switches[column] |= _BV(row);
+    } else {
+        switches[column] &= ~_BV(row);
+    }
+}
+
+bool host_port_key(uint8_t column, uint8_t row) {
+    return switches[column] & _BV(row);
+}
+
+/*
+** Every switch has a diode from its column to its row. Rows are pulled down
+** externally, column inputs only have the internal pull-ups.
+*/
+uint8_t host_pind_read(void) {
+    uint8_t pind = PORTD & DDRD;
+    for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+        uint8_t mask = _BV(column_pin[i]);
+        if ((*column_ddr[i] & mask) && (*column_port[i] & mask)) {
+            pind |= switches[i] & ~DDRD;
+        }
+    }
+    return pind;
+}
+
+static uint8_t host_column_read(volatile uint8_t *port, volatile uint8_t *ddr) {
+    uint8_t rows_low = DDRD & ~PORTD;
+    uint8_t pin = *port & *ddr;
+    for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+        uint8_t mask = _BV(column_pin[i]);
+        if (column_port[i] != port || (*ddr & mask)) {
+            continue;
+        }
+        if ((*port & mask) && !(switches[i] & rows_low)) {
+            pin |= mask;
+        }
+    }
+    return pin;
+}
+
+uint8_t host_pinb_read(void) {
+    return host_column_read(&PORTB, &DDRB);
+}
+
+uint8_t host_pinf_read(void) {
+    return host_column_read(&PORTF, &DDRF);
+}
@@ -0,0 +1,11 @@
+#ifndef HOST_PORT_H
+#define HOST_PORT_H
+
+#include <stdint.h>
+#include "../matrix.h"
+
+void host_port_reset(void);
+void host_port_set_key(uint8_t column, uint8_t row, bool pressed);
+bool host_port_key(uint8_t column, uint8_t row);
+
+#endif
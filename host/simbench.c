@@ -0,0 +1,247 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "avr_ioport.h"
+
+/*
+** Cycle-accurate benchmark of the avr-gcc build under simavr.
+**
+** Loads the firmware ELF, plays the diode matrix against whatever the
+** firmware drives on PORTB/PORTD/PORTF, and times the hot functions and
+** interrupt handlers by watching the program counter and stack pointer.
+** Symbols come from `avr-nm` on stdin. Output is tab separated, one line per
+** metric, so that two runs can be diffed.
+**
+** Unverified: it has only been compile-checked against stub headers and has
+** never run against a real avr-gcc build and libsimavr.
+*/
+
+#define F_CPU 16000000UL
+#define RUN_MS 2500
+#define CYCLES_PER_MS (F_CPU / 1000)
+#define DEPTH_MAX 8
+
+#define COLUMN_COUNT 14
+
+/* Data space addresses of the port registers */
+#define DDRB 0x24
+#define PORTB 0x25
+#define DDRD 0x2A
+#define PORTD 0x2B
+#define DDRF 0x30
+#define PORTF 0x31
+
+typedef struct {
+    const char *name;
+    const char *symbol;
+    uint32_t address;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} probe_t;
+
+static probe_t probes[] = {
+    { .name = "scan", .symbol = "matrix_scan" },
+    { .name = "debounce", .symbol = "debounce_update" },
+    { .name = "report", .symbol = "report_update" },
+    { .name = "idle_poll", .symbol = "idle_poll" },
+    { .name = "isr_usb_gen", .symbol = "__vector_10" },
+    { .name = "isr_usb_com", .symbol = "__vector_11" },
+    { .name = "isr_timer3", .symbol = "__vector_32" },
+};
+#define PROBE_COUNT (sizeof(probes) / sizeof(probes[0]))
+
+typedef struct {
+    probe_t *probe;
+    uint16_t sp;
+    avr_cycle_count_t start;
+    avr_cycle_count_t nested; /* spent in probes called or interrupting from here */
+} frame_t;
+
+typedef struct {
+    uint16_t ms;
+    uint8_t column;
+    uint8_t row;
+    bool pressed;
+} key_event_t;
+
+/* Typing, a chord and a fast burst, then silence long enough to park the scanner */
+static const key_event_t script[] = {
+    { 10, 5, 2, true }, { 50, 8, 3, true }, { 70, 5, 2, false }, { 90, 3, 2, true },
+    { 110, 8, 3, false }, { 130, 6, 2, true }, { 150, 3, 2, false }, { 170, 6, 2, false },
+    { 200, 0, 4, true }, { 230, 1, 3, true }, { 290, 1, 3, false }, { 320, 0, 4, false },
+    { 400, 3, 3, true }, { 404, 3, 3, false }, { 408, 3, 3, true }, { 412, 3, 3, false },
+    { 2000, 9, 2, true }, { 2080, 9, 2, false },
+};
+
+/* Physical wiring, see matrix_init() */
+static const uint8_t column_port[COLUMN_COUNT] = {
+    'F', 'F', 'F', 'F', 'F', 'F', 'B', 'B', 'B', 'B', 'B', 'B', 'B', 'B',
+};
+static const uint8_t column_pin[COLUMN_COUNT] = {
+    7, 6, 5, 4, 1, 0, 0, 1, 2, 3, 4, 5, 6, 7,
+};
+
+static uint8_t switches[COLUMN_COUNT];
+static uint8_t last_registers[6];
+
+static uint8_t reg(avr_t *avr, uint16_t address) {
+    return avr->data[address];
+}
+
+static void drive(avr_t *avr, char port, uint8_t pins, uint8_t levels) {
+    for (uint8_t i = 0; i < 8; ++i) {
+        if (pins & (1 << i)) {
+            avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(port), i), (levels >> i) & 1);
+        }
+    }
+}
+
+/*
+** Every switch has a diode from its column to its row. Rows are pulled down
+** externally, columns only have the internal pull-ups. Same model as
+** host/port.c, evaluated whenever the firmware changes a port or DDR.
+*/
+static void matrix_settle(avr_t *avr) {
+    uint8_t now[6] = {
+        reg(avr, PORTB), reg(avr, DDRB), reg(avr, PORTD), reg(avr, DDRD), reg(avr, PORTF), reg(avr, DDRF),
+    };
+    if (memcmp(now, last_registers, sizeof(now)) == 0) {
+        return;
+    }
+    memcpy(last_registers, now, sizeof(now));
+
+    uint8_t rows_high = 0x00;
+    uint8_t rows_low = reg(avr, DDRD) & ~reg(avr, PORTD);
+    uint8_t column_b = reg(avr, PORTB);
+    uint8_t column_f = reg(avr, PORTF);
+    for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+        uint8_t mask = 1 << column_pin[i];
+        uint8_t ddr = reg(avr, column_port[i] == 'B' ? DDRB : DDRF);
+        uint8_t port = reg(avr, column_port[i] == 'B' ? PORTB : PORTF);
+        uint8_t *input = column_port[i] == 'B' ? &column_b : &column_f;
+        if ((ddr & mask) && (port & mask)) {
+            rows_high |= switches[i];
+        }
+        if (!(ddr & mask) && (switches[i] & rows_low)) {
+            *input &= ~mask;
+        }
+    }
+    drive(avr, 'D', 0b00011111 & ~reg(avr, DDRD), rows_high);
+    drive(avr, 'B', ~reg(avr, DDRB), column_b);
+    drive(avr, 'F', 0b11110011 & ~reg(avr, DDRF), column_f);
+}
+
+static void load_symbols(void) {
+    char line[256];
+    while (fgets(line, sizeof(line), stdin)) {
+        unsigned long address;
+        char type;
+        char name[200];
+        if (sscanf(line, "%lx %c %199s", &address, &type, name) != 3) {
+            continue;
+        }
+        for (size_t i = 0; i < PROBE_COUNT; ++i) {
+            if (strcmp(name, probes[i].symbol) == 0) {
+                probes[i].address = address;
+            }
+        }
+    }
+}
+
+static uint16_t stack_pointer(avr_t *avr) {
+    return avr->data[R_SPL] | avr->data[R_SPH] << 8;
+}
+
+static void record(probe_t *probe, uint64_t cycles) {
+    if (probe->count == 0 || cycles < probe->min) {
+        probe->min = cycles;
+    }
+    if (cycles > probe->max) {
+        probe->max = cycles;
+    }
+    probe->sum += cycles;
+    probe->count += 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: avr-nm firmware.elf | %s firmware.elf\n", argv[0]);
+        return 2;
+    }
+    load_symbols();
+
+    elf_firmware_t firmware = { 0 };
+    if (elf_read_firmware(argv[1], &firmware) != 0) {
+        fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[1]);
+        return 1;
+    }
+    avr_t *avr = avr_make_mcu_by_name("atmega32u4");
+    if (avr == NULL) {
+        fprintf(stderr, "%s: simavr has no atmega32u4 core\n", argv[0]);
+        return 1;
+    }
+    avr_init(avr);
+    avr->frequency = F_CPU;
+    avr_load_firmware(avr, &firmware);
+
+    frame_t stack[DEPTH_MAX];
+    uint8_t depth = 0;
+    size_t next = 0;
+    avr_cycle_count_t end = (avr_cycle_count_t)RUN_MS * CYCLES_PER_MS;
+
+    while (avr->cycle < end) {
+        while (next < sizeof(script) / sizeof(script[0])
+            && avr->cycle >= (avr_cycle_count_t)script[next].ms * CYCLES_PER_MS) {
+            const key_event_t *e = &script[next++];
+            if (e->pressed) {
+                switches[e->column] |= 1 << e->row;
+            } else {
+                switches[e->column] &= ~(1 << e->row);
+            }
+            memset(last_registers, 0xFF, sizeof(last_registers));
+        }
+        matrix_settle(avr);
+
+        int state = avr_run(avr);
+        if (state == cpu_Done || state == cpu_Crashed) {
+            fprintf(stderr, "%s: simulation stopped (%d)\n", argv[0], state);
+            return 1;
+        }
+
+        uint16_t sp = stack_pointer(avr);
+        while (depth && sp > stack[depth - 1].sp) {
+            frame_t *f = &stack[--depth];
+            uint64_t total = avr->cycle - f->start;
+            record(f->probe, total - f->nested);
+            if (depth) {
+                stack[depth - 1].nested += total;
+            }
+        }
+        for (size_t i = 0; i < PROBE_COUNT; ++i) {
+            if (probes[i].address && avr->pc == probes[i].address && depth < DEPTH_MAX
+                && (depth == 0 || stack[depth - 1].probe != &probes[i] || stack[depth - 1].sp != sp)) {
+                stack[depth++] = (frame_t){ .probe = &probes[i], .sp = sp, .start = avr->cycle };
+            }
+        }
+    }
+
+    printf("# metric\tname\tcount\tmin\tmean\tmax\n");
+    for (size_t i = 0; i < PROBE_COUNT; ++i) {
+        const probe_t *p = &probes[i];
+        printf("cycles\t%s\t%llu\t%llu\t%.1f\t%llu\n", p->name,
+            (unsigned long long)p->count,
+            (unsigned long long)p->min,
+            p->count ? (double)p->sum / p->count : 0.0,
+            (unsigned long long)p->max);
+    }
+    printf("size\tflash\t%u\n", (unsigned)(firmware.flashsize));
+    printf("size\tsram_data\t%u\n", (unsigned)(firmware.datasize));
+    printf("size\tsram_bss\t%u\n", (unsigned)(firmware.bsssize));
+    printf("size\tsram_static\t%u\n", (unsigned)(firmware.datasize + firmware.bsssize));
+    return 0;
+}
@@ -0,0 +1,243 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <avr/io.h>
+#include "../matrix.h"
+#include "../report.h"
+#include "../keymap.h"
+#include "../taphold.h"
+#include "../usb_hid_keys.h"
+
+/*
+** Tap-hold tests of taphold.c through report_update().
+**
+** Feeds debounced matrix states one scan at a time and takes one report per
+** scan the way a 1 ms host poll does, then checks which scan every keycode
+** reached the host on. A tap has to ship on the scan its release is seen, no
+** matter how long the key was down.
+*/
+
+#define SPACE_COLUMN 6
+#define SPACE_ROW 2
+
+static unsigned failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+        ++failures; \
+    } \
+} while (false)
+
+static uint8_t keys[COLUMN_COUNT];
+static uint8_t shipped[REPORT_INPUT_SIZE];
+static bool fresh; /* a report was taken on the last scan */
+static uint32_t scans = 0;
+
+static void key(uint8_t column, uint8_t row, bool pressed) {
+    if (pressed) {
+        keys[column] |= _BV(row);
+    } else {
+        keys[column] &= ~_BV(row);
+    }
+}
+
+static void scan(void) {
+    report_update(keys, scans++);
+    fresh = false;
+    if (report_queue_length()) {
+        const report_slot_t *slot = report_queue_front();
+        for (uint8_t i = 0; i < REPORT_INPUT_SIZE; ++i) {
+            shipped[i] = slot->data[i];
+        }
+        report_queue_pop();
+        fresh = true;
+    }
+}
+
+/* Scans n times, true if any of them took a report */
+static bool scan_n(uint16_t n) {
+    bool any = false;
+    for (uint16_t i = 0; i < n; ++i) {
+        scan();
+        any |= fresh;
+    }
+    return any;
+}
+
+static bool sent(uint8_t keycode) {
+    if (keycode >= KEY_LEFTCTRL) {
+        return shipped[1] & _BV(keycode - KEY_LEFTCTRL);
+    }
+    return shipped[2 + keycode / 8] & _BV(keycode % 8);
+}
+
+static bool sent_nothing(void) {
+    uint8_t any = 0x00;
+    for (uint8_t i = 1; i < REPORT_INPUT_SIZE; ++i) {
+        any |= shipped[i];
+    }
+    return any == 0x00;
+}
+
+static void release_all(void) {
+    for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+        keys[i] = 0x00;
+    }
+    scan_n(TAPHOLD_TERM + 8);
+    CHECK(sent_nothing());
+}
+
+/* Tap of every length below the term ships on the release scan */
+static void test_tap(void) {
+    for (uint16_t held = 1; held < TAPHOLD_TERM; ++held) {
+        key(SPACE_COLUMN, SPACE_ROW, true);
+        CHECK(!scan_n(held));
+        key(SPACE_COLUMN, SPACE_ROW, false);
+        scan();
+        CHECK(fresh && sent(KEY_SPACE) && !sent(KEY_LEFTCTRL));
+        scan();
+        CHECK(fresh && sent_nothing());
+    }
+    release_all();
+}
+
+/* Held alone, the hold keycode ships exactly one term after the press */
+static void test_timeout(void) {
+    key(SPACE_COLUMN, SPACE_ROW, true);
+    CHECK(!scan_n(TAPHOLD_TERM));
+    scan();
+    CHECK(fresh && sent(KEY_LEFTCTRL) && !sent(KEY_SPACE));
+    CHECK(!scan_n(100));
+    key(SPACE_COLUMN, SPACE_ROW, false);
+    scan();
+    CHECK(fresh && sent_nothing());
+    release_all();
+}
+
+/* A key pressed and released under it decides hold on that release */
+static void test_nested(void) {
+    key(SPACE_COLUMN, SPACE_ROW, true);
+    scan();
+    key(1, 3, true); /* A */
+    CHECK(!scan_n(5));
+    key(1, 3, false);
+    scan();
+    CHECK(fresh && sent(KEY_LEFTCTRL) && sent(KEY_A));
+    scan();
+    CHECK(fresh && sent(KEY_LEFTCTRL) && !sent(KEY_A));
+    key(SPACE_COLUMN, SPACE_ROW, false);
+    scan();
+    CHECK(fresh && sent_nothing());
+    release_all();
+}
+
+/* Rolling over it into another key is still a tap */
+static void test_roll(void) {
+    key(SPACE_COLUMN, SPACE_ROW, true);
+    scan();
+    key(1, 3, true); /* A */
+    CHECK(!scan_n(5));
+    key(SPACE_COLUMN, SPACE_ROW, false);
+    scan();
+    CHECK(fresh && sent(KEY_SPACE) && sent(KEY_A) && !sent(KEY_LEFTCTRL));
+    scan();
+    CHECK(fresh && !sent(KEY_SPACE) && sent(KEY_A));
+    key(1, 3, false);
+    scan();
+    CHECK(fresh && sent_nothing());
+    release_all();
+}
+
+/* Buffered events come out in the order they happened */
+static void test_order(void) {
+    key(SPACE_COLUMN, SPACE_ROW, true);
+    scan();
+    key(1, 3, true); /* A */
+    scan();
+    key(2, 3, true); /* S */
+    scan();
+    key(1, 3, false);
+    scan();
+    CHECK(fresh && sent(KEY_LEFTCTRL) && sent(KEY_A) && sent(KEY_S));
+    scan();
+    CHECK(fresh && sent(KEY_LEFTCTRL) && !sent(KEY_A) && sent(KEY_S));
+    release_all();
+}
+
+/* Keys are not held back while nothing is undecided */
+static void test_passthrough(void) {
+    key(1, 3, true);
+    scan();
+    CHECK(fresh && sent(KEY_A));
+    key(SPACE_COLUMN, SPACE_ROW, true);
+    CHECK(!scan_n(3));
+    key(1, 3, false); /* pressed before, so it does not decide hold */
+    CHECK(!scan_n(3));
+    key(SPACE_COLUMN, SPACE_ROW, false);
+    scan();
+    CHECK(fresh && sent(KEY_SPACE) && !sent(KEY_A));
+    release_all();
+}
+
+/* More events than the buffer holds decide hold */
+static void test_overflow(void) {
+    key(SPACE_COLUMN, SPACE_ROW, true);
+    scan();
+    uint8_t pressed = 0;
+    for (uint8_t i = 1; i <= 5 && pressed <= TAPHOLD_BUFFER_SIZE; ++i) {
+        for (uint8_t j = 1; j <= 3 && pressed <= TAPHOLD_BUFFER_SIZE; ++j, ++pressed) {
+            key(i, j, true);
+        }
+    }
+    for (uint8_t j = 1; j <= 3 && pressed <= TAPHOLD_BUFFER_SIZE; ++j, ++pressed) {
+        key(8, j, true);
+    }
+    scan();
+    CHECK(fresh && sent(KEY_LEFTCTRL) && sent(KEY_Q) && sent(KEY_Y));
+    release_all();
+}
+
+/*
+** Five keys remapped to A and flipped together every scan queue events
+** faster than the one change per keycode and tick that goes out, until the
+** output ring is full. Y released in that state still reaches the host.
+*/
+static void test_backlog(void) {
+    uint16_t overflows = taphold_overflows;
+    for (uint8_t i = 1; i <= 5; ++i) {
+        keymap_set(0, i, 2, KEY_A);
+    }
+    key(8, 2, true); /* Y */
+    scan();
+    CHECK(fresh && sent(KEY_Y));
+    for (uint8_t n = 0; n < 21; ++n) {
+        for (uint8_t i = 1; i <= 5; ++i) {
+            key(i, 2, n % 2 == 0);
+        }
+        scan();
+    }
+    for (uint8_t i = 1; i <= 5; ++i) {
+        key(i, 2, false);
+    }
+    key(8, 2, false);
+    release_all();
+    CHECK(taphold_overflows > overflows);
+    keymap_reset();
+}
+
+int main(void) {
+    keymap_init();
+
+    test_tap();
+    test_timeout();
+    test_nested();
+    test_roll();
+    test_order();
+    test_passthrough();
+    test_overflow();
+    test_backlog();
+
+    printf("%u scans, term %u scans\n", (unsigned)scans, (unsigned)TAPHOLD_TERM);
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}
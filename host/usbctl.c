@@ -0,0 +1,334 @@
+#include <stdint.h>
+#include <string.h>
+#include <avr/io.h>
+#include "usbctl.h"
+
+/*
+** Each endpoint keeps an RX bank (SETUP and OUT data), a TX bank being
+** filled through UEDATX, and up to two committed TX banks waiting for an IN
+** token. Flags cleared by the firmware are noticed on the next register
+** access and turned into bank switches, as the controller would.
+*/
+
+#define HOST_USB_BANK_SIZE 64
+#define HOST_USB_SERVICE_LIMIT 64
+#define HOST_USB_RETRY_LIMIT 16
+
+volatile uint8_t UHWCON, PLLCSR, USBCON, UDCON, UDIEN, UDINT, UDADDR;
+volatile uint8_t UENUM, UERST;
+volatile uint16_t UDFNUM;
+host_endpoint_registers_t host_endpoint_registers[8];
+host_usb_stats_t host_usb_stats;
+
+void USB_GEN_vect(void);
+void USB_COM_vect(void);
+
+typedef struct {
+    uint8_t ueintx;
+    uint8_t seen; /* ueintx as of the last sync */
+    bool allocated;
+    uint8_t rx[HOST_USB_BANK_SIZE];
+    uint8_t rx_length;
+    uint8_t rx_position;
+    uint8_t tx[HOST_USB_BANK_SIZE];
+    uint8_t tx_length;
+    uint8_t committed[2][HOST_USB_BANK_SIZE];
+    uint8_t committed_length[2];
+    uint8_t committed_count;
+    uint8_t scratch;
+} host_endpoint_t;
+
+static host_endpoint_t endpoints[8];
+
+static bool is_control(uint8_t n) {
+    return (host_endpoint_registers[n].uecfg0x & 0b11000000) == 0;
+}
+
+static bool is_in(uint8_t n) {
+    return host_endpoint_registers[n].uecfg0x & 0b00000001;
+}
+
+static uint8_t bank_count(uint8_t n) {
+    return (host_endpoint_registers[n].uecfg1x & 0b00001100) ? 2 : 1;
+}
+
+static uint8_t bank_size(uint8_t n) {
+    return 8 << ((host_endpoint_registers[n].uecfg1x >> 4) & 0b111);
+}
+
+static void endpoint_set(uint8_t n, uint8_t bits) {
+    endpoints[n].ueintx |= bits;
+    endpoints[n].seen |= bits;
+}
+
+/* Apply what the firmware did to UEINTX since the last look */
+static void sync_endpoint(uint8_t n) {
+    host_endpoint_t *ep = &endpoints[n];
+    if (!ep->allocated && (host_endpoint_registers[n].uecfg1x & 0b00000010)) {
+        ep->allocated = true;
+        ep->ueintx = ep->seen = (!is_control(n) && is_in(n)) ? _BV(TXINI) | _BV(FIFOCON) : 0;
+    }
+    uint8_t cleared = ep->seen & ~ep->ueintx;
+    if (is_control(n)) {
+        if (cleared & (_BV(RXSTPI) | _BV(RXOUTI))) {
+            ep->rx_length = ep->rx_position = 0;
+        }
+        if (cleared & _BV(TXINI)) {
+            memcpy(ep->committed[0], ep->tx, ep->tx_length);
+            ep->committed_length[0] = ep->tx_length;
+            ep->committed_count = 1;
+            ep->tx_length = 0;
+        }
+    } else if (is_in(n)) {
+        if (cleared & _BV(FIFOCON)) {
+            uint8_t slot = ep->committed_count++;
+            memcpy(ep->committed[slot], ep->tx, ep->tx_length);
+            ep->committed_length[slot] = ep->tx_length;
+            ep->tx_length = 0;
+            if (ep->committed_count < bank_count(n)) {
+                ep->ueintx |= _BV(TXINI) | _BV(FIFOCON);
+            }
+        }
+    } else if (cleared & _BV(FIFOCON)) {
+        ep->rx_length = ep->rx_position = 0;
+    }
+    ep->seen = ep->ueintx;
+}
+
+static void sync(void) {
+    for (uint8_t n = 0; n < 8; ++n) {
+        sync_endpoint(n);
+    }
+}
+
+volatile uint8_t *host_ueintx(void) {
+    sync();
+    return (volatile uint8_t *)&endpoints[UENUM & 7].ueintx;
+}
+
+volatile uint8_t *host_uedatx(void) {
+    sync();
+    uint8_t n = UENUM & 7;
+    host_endpoint_t *ep = &endpoints[n];
+    bool reading = is_control(n) ? (ep->ueintx & (_BV(RXSTPI) | _BV(RXOUTI))) : !is_in(n);
+    if (reading) {
+        ep->scratch = ep->rx_position < ep->rx_length ? ep->rx[ep->rx_position++] : 0x00;
+        return &ep->scratch;
+    }
+    if (ep->tx_length < bank_size(n)) {
+        return &ep->tx[ep->tx_length++];
+    }
+    return &ep->scratch; /* overflow, the byte is lost like on the chip */
+}
+
+uint8_t host_uebclx(void) {
+    sync();
+    host_endpoint_t *ep = &endpoints[UENUM & 7];
+    return is_in(UENUM & 7) ? ep->tx_length : ep->rx_length - ep->rx_position;
+}
+
+uint8_t host_uesta0x(void) {
+    return (host_endpoint_registers[UENUM & 7].uecfg1x & 0b00000010) ? _BV(CFGOK) : 0x00;
+}
+
+uint8_t host_ueint(void) {
+    sync();
+    uint8_t pending = 0x00;
+    for (uint8_t n = 0; n < 8; ++n) {
+        if (endpoints[n].ueintx & host_endpoint_registers[n].ueienx & 0b01011111) {
+            pending |= _BV(n);
+        }
+    }
+    return pending;
+}
+
+/* Raise interrupts until the firmware has nothing left to do */
+void host_usb_service(void) {
+    for (uint8_t i = 0; i < HOST_USB_SERVICE_LIMIT; ++i) {
+        sync();
+        if (UDINT & UDIEN & 0b01111101) {
+            USB_GEN_vect();
+        } else if (host_ueint()) {
+            USB_COM_vect();
+        } else {
+            return;
+        }
+        ++host_usb_stats.isr_calls;
+    }
+}
+
+void host_usb_power_on(void) {
+    memset(endpoints, 0, sizeof(endpoints));
+    memset(host_endpoint_registers, 0, sizeof(host_endpoint_registers));
+    memset(&host_usb_stats, 0, sizeof(host_usb_stats));
+    UHWCON = USBCON = UDCON = UDIEN = UDINT = UDADDR = 0x00;
+    UENUM = UERST = 0x00;
+    UDFNUM = 0;
+    PLLCSR = _BV(PLOCK); /* the PLL locks instantly */
+}
+
+void host_usb_bus_reset(void) {
+    for (uint8_t n = 0; n < 8; ++n) {
+        memset(&endpoints[n], 0, sizeof(endpoints[n]));
+        host_endpoint_registers[n].ueconx = 0x00;
+        host_endpoint_registers[n].uecfg0x = 0x00;
+        host_endpoint_registers[n].uecfg1x = 0x00;
+        host_endpoint_registers[n].ueienx = 0x00;
+    }
+    UDADDR = 0x00;
+    UDINT |= _BV(EORSTI);
+    host_usb_service();
+}
+
+void host_usb_sof(void) {
+    ++host_usb_stats.frames;
+    if (USBCON & _BV(FRZCLK)) {
+        return;
+    }
+    UDFNUM = (UDFNUM + 1) & 0x07FF;
+    UDINT |= _BV(SOFI);
+    host_usb_service();
+}
+
+void host_usb_suspend(void) {
+    UDINT |= _BV(SUSPI);
+    host_usb_service();
+}
+
+void host_usb_resume(void) {
+    UDINT |= _BV(WAKEUPI);
+    host_usb_service();
+}
+
+/* IN token, returns the packet length, HOST_USB_NAK or HOST_USB_STALL */
+int host_usb_in(uint8_t endpoint, uint8_t *data) {
+    ++host_usb_stats.tokens;
+    host_usb_service(); /* whatever the firmware enabled since runs first */
+    host_endpoint_t *ep = &endpoints[endpoint];
+    if (host_endpoint_registers[endpoint].ueconx & _BV(STALLRQ)) {
+        return HOST_USB_STALL;
+    }
+    if (ep->committed_count == 0) {
+        ++host_usb_stats.naks;
+        return HOST_USB_NAK;
+    }
+    int length = ep->committed_length[0];
+    memcpy(data, ep->committed[0], length);
+    ep->committed_count -= 1;
+    memmove(ep->committed[0], ep->committed[1], ep->committed_length[1]);
+    ep->committed_length[0] = ep->committed_length[1];
+    if (is_control(endpoint) || !(ep->ueintx & _BV(TXINI))) {
+        endpoint_set(endpoint, _BV(TXINI) | (is_control(endpoint) ? 0 : _BV(FIFOCON)));
+    }
+    host_usb_service();
+    return length;
+}
+
+/* OUT token, returns the packet length or HOST_USB_NAK while the bank is busy */
+int host_usb_out(uint8_t endpoint, const uint8_t *data, uint8_t length) {
+    ++host_usb_stats.tokens;
+    host_usb_service(); /* whatever the firmware enabled since runs first */
+    host_endpoint_t *ep = &endpoints[endpoint];
+    if (host_endpoint_registers[endpoint].ueconx & _BV(STALLRQ)) {
+        return HOST_USB_STALL;
+    }
+    if (ep->ueintx & (_BV(RXOUTI) | _BV(RXSTPI)) || ep->rx_length) {
+        ++host_usb_stats.naks;
+        return HOST_USB_NAK;
+    }
+    memcpy(ep->rx, data, length);
+    ep->rx_length = length;
+    ep->rx_position = 0;
+    endpoint_set(endpoint, _BV(RXOUTI) | (is_control(endpoint) ? 0 : _BV(FIFOCON)));
+    host_usb_service();
+    return length;
+}
+
+static int retry_in(uint8_t *data) {
+    for (uint8_t i = 0; i < HOST_USB_RETRY_LIMIT; ++i) {
+        int length = host_usb_in(0, data);
+        if (length != HOST_USB_NAK) {
+            return length;
+        }
+        host_usb_service();
+    }
+    return HOST_USB_NAK;
+}
+
+static int retry_out(const uint8_t *data, uint8_t length) {
+    for (uint8_t i = 0; i < HOST_USB_RETRY_LIMIT; ++i) {
+        int result = host_usb_out(0, data, length);
+        if (result != HOST_USB_NAK) {
+            return result;
+        }
+        host_usb_service();
+    }
+    return HOST_USB_NAK;
+}
+
+/* SETUP token alone, for tests that cut a transfer short */
+int host_usb_setup(const uint8_t setup[8]) {
+    ++host_usb_stats.tokens;
+    sync();
+    host_endpoint_t *ep = &endpoints[0];
+    host_endpoint_registers[0].ueconx &= ~_BV(STALLRQ);
+    memcpy(ep->rx, setup, 8);
+    ep->rx_length = 8;
+    ep->rx_position = 0;
+    ep->tx_length = 0;
+    ep->committed_count = 0;
+    endpoint_set(0, _BV(RXSTPI) | _BV(TXINI));
+    host_usb_service();
+    if (host_endpoint_registers[0].ueconx & _BV(STALLRQ)) {
+        return HOST_USB_STALL;
+    }
+    return 0;
+}
+
+/*
+** One control transfer on EP0: SETUP, data stage in 64 byte packets and the
+** status stage. Returns the data stage length, HOST_USB_STALL or HOST_USB_NAK
+** when the device never answered.
+*/
+int host_usb_control(const uint8_t setup[8], uint8_t *data, uint16_t capacity) {
+    uint16_t length = setup[6] | setup[7] << 8;
+    uint8_t packet[HOST_USB_BANK_SIZE];
+
+    int result = host_usb_setup(setup);
+    if (result < 0) {
+        return result;
+    }
+
+    uint16_t total = 0;
+    if (setup[0] & 0x80) {
+        while (total < length) {
+            int received = retry_in(packet);
+            if (received < 0) {
+                return received;
+            }
+            for (int i = 0; i < received && total < capacity; ++i) {
+                data[total + i] = packet[i];
+            }
+            total += received;
+            if (received < HOST_USB_BANK_SIZE) {
+                break;
+            }
+        }
+        int status = retry_out(packet, 0);
+        return status < 0 ? status : total;
+    }
+
+    while (total < length) {
+        uint8_t chunk = length - total < HOST_USB_BANK_SIZE ? length - total : HOST_USB_BANK_SIZE;
+        int sent = retry_out(data + total, chunk);
+        if (sent < 0) {
+            return sent;
+        }
+        total += chunk;
+    }
+    int status = retry_in(packet);
+    if (status > 0) {
+        return HOST_USB_STALL; /* status stage must be a zero length packet */
+    }
+    return status < 0 ? status : total;
+}
@@ -0,0 +1,38 @@
+#ifndef HOST_USBCTL_H
+#define HOST_USBCTL_H
+
+#include <stdint.h>
+
+/*
+** Register model of the ATmega32U4 USB device controller.
+**
+** The firmware's USB_GEN_vect and USB_COM_vect run unmodified against it.
+** The functions below play the host side of the bus, one token at a time,
+** and raise the interrupts the firmware enabled until it goes quiet.
+*/
+
+#define HOST_USB_STALL (-1)
+#define HOST_USB_NAK (-2)
+
+typedef struct {
+    uint32_t isr_calls;
+    uint32_t tokens;
+    uint32_t naks;
+    uint32_t frames;
+} host_usb_stats_t;
+
+extern host_usb_stats_t host_usb_stats;
+
+void host_usb_power_on(void);
+void host_usb_bus_reset(void);
+void host_usb_sof(void);
+void host_usb_suspend(void);
+void host_usb_resume(void);
+void host_usb_service(void);
+
+int host_usb_setup(const uint8_t setup[8]);
+int host_usb_control(const uint8_t setup[8], uint8_t *data, uint16_t capacity);
+int host_usb_in(uint8_t endpoint, uint8_t *data);
+int host_usb_out(uint8_t endpoint, const uint8_t *data, uint8_t length);
+
+#endif
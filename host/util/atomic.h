@@ -0,0 +1,8 @@
+#ifndef HOST_UTIL_ATOMIC_H
+#define HOST_UTIL_ATOMIC_H
+
+/* Host builds are single threaded and call interrupt handlers explicitly */
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type) for (int host_atomic_once = 1; host_atomic_once; host_atomic_once = 0)
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef HOST_UTIL_SETBAUD_H
+#define HOST_UTIL_SETBAUD_H
+
+/* Normal speed divisor as avr-libc computes it, without the tolerance checks */
+#define UBRR_VALUE (((F_CPU) + 8UL * (BAUD)) / (16UL * (BAUD)) - 1UL)
+#define USE_2X 0
+
+#endif
@@ -0,0 +1,78 @@
+#include <stdint.h>
+#include <avr/io.h>
+#include "idle.h"
+#include "matrix.h"
+#include "debounce.h"
+#include "scheduler.h"
+
+/* Debounce counters must have run out before the scanner stops feeding them */
+static_assert(IDLE_SCANS == 0 || IDLE_SCANS > DEBOUNCE_TICKS);
+
+uint16_t idle_wake_us = 0;
+uint16_t idle_wake_max_us = 0;
+uint16_t idle_wakes = 0;
+
+static bool idle_parked = false;
+static uint16_t idle_empty = 0;
+static volatile bool idle_woken = false;
+static volatile uint32_t idle_woken_stamp = 0;
+
+/* Resume scanning on the next tick, for anything other than the matrix that sees a key */
+void idle_wake(void) {
+    idle_woken_stamp = scheduler_timestamp();
+    idle_woken = true;
+}
+
+/*
+** Called once per tick instead of a full scan. Returns true while parked and
+** nothing is pressed, so a press resumes scanning on the very next tick and
+** is never more than one scan period late. Every wake is counted and timed
+** to the scan it resumes: from its tick for a press on the matrix, from the
+** idle_wake() call otherwise.
+*/
+bool idle_poll(void) {
+    if (!idle_parked) {
+        return false;
+    }
+    uint32_t stamp;
+    if (idle_woken) {
+        stamp = idle_woken_stamp;
+    } else if (matrix_idle_poll()) {
+        stamp = scheduler_tick_timestamp();
+    } else {
+        return true;
+    }
+    matrix_idle_exit();
+    idle_parked = false;
+    idle_empty = 0;
+    ++idle_wakes;
+    uint32_t elapsed = (scheduler_timestamp() - stamp) / SCHEDULER_COUNTS_PER_US;
+    idle_wake_us = elapsed > 0xFFFF ? 0xFFFF : elapsed;
+    if (idle_wake_us > idle_wake_max_us) {
+        idle_wake_max_us = idle_wake_us;
+    }
+    return false;
+}
+
+/* Count empty scans and park once IDLE_SCANS of them are in a row */
+void idle_update(const uint8_t raw[COLUMN_COUNT], const uint8_t debounced[COLUMN_COUNT]) {
+#if IDLE_SCANS
+    uint8_t any = 0x00;
+    for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+        any |= (raw[i] | debounced[i]) & (_BV(ROW_COUNT) - 1);
+    }
+    if (any) {
+        idle_empty = 0;
+        return;
+    }
+    if (++idle_empty < IDLE_SCANS) {
+        return;
+    }
+    idle_woken = false;
+    matrix_idle_enter();
+    idle_parked = true;
+#else
+    (void)raw;
+    (void)debounced;
+#endif
+}
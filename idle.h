@@ -0,0 +1,27 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <stdint.h>
+#include "matrix.h"
+
+/* Empty scans before the scanner parks, 0 to scan forever */
+#ifndef IDLE_SCANS
+#define IDLE_SCANS 1000
+#endif
+
+/*
+** While parked the rows are polled once per tick, so a press on the matrix
+** resumes scanning within one scan period; how far into that period it came
+** is not seen. The wake stats count every resume and time it from the tick
+** that saw the press, or from the idle_wake() call of a link frame, to the
+** scan it resumes.
+*/
+extern uint16_t idle_wake_us;
+extern uint16_t idle_wake_max_us;
+extern uint16_t idle_wakes;
+
+bool idle_poll(void);
+void idle_wake(void);
+void idle_update(const uint8_t raw[COLUMN_COUNT], const uint8_t debounced[COLUMN_COUNT]);
+
+#endif
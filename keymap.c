@@ -0,0 +1,342 @@
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <util/atomic.h>
+#include "matrix.h"
+#include "keymap.h"
+#include "macro.h"
+#include "taphold.h"
+#include "usb_hid_keys.h"
+#include "utility.h"
+
+static const uint8_t keymap_default[LAYER_COUNT][COLUMN_COUNT][ROW_COUNT] PROGMEM = {
+    [0] = {
+        { KEY_LEFTALT, KEY_GRAVE, KEY_TAB, KEY_BACKSPACE, KEY_LEFTSHIFT },
+        { KEY_F1, KEY_1, KEY_Q, KEY_A, KEY_Z },
+        { KEY_F2, KEY_2, KEY_W, KEY_S, KEY_X },
+        { KEY_F3, KEY_3, KEY_E, KEY_D, KEY_C },
+        { KEY_F4, KEY_4, KEY_R, KEY_F, KEY_V },
+        { KEY_F5, KEY_5, KEY_T, KEY_G, KEY_B },
+        { KEY_F6, KEY_6, TAPHOLD(0), KEY_APOSTROPHE, KEY_LEFTCTRL },
+        { KEY_F7, KEY_7, KEY_RIGHTBRACE, KEY_LEFTBRACE, LAYER_MO(1) },
+        { KEY_F8, KEY_8, KEY_Y, KEY_H, KEY_N },
+        { KEY_F9, KEY_9, KEY_U, KEY_J, KEY_M },
+        { KEY_F10, KEY_0, KEY_I, KEY_K, KEY_COMMA },
+        { KEY_F11, KEY_MINUS, KEY_O, KEY_L, KEY_DOT },
+        { KEY_F12, KEY_EQUAL, KEY_P, KEY_SEMICOLON, KEY_SLASH },
+        { KEY_RIGHTMETA, KEY_ESC, KEY_BACKSLASH, KEY_ENTER, KEY_RIGHTSHIFT },
+    },
+    [1] = { /* Fn */
+        { KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_DELETE, KEY_TRNS },
+        { MACRO(0), KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS },
+        { KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS },
+        { KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS },
+        { KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS },
+        { KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS },
+        { KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS },
+        { KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS },
+        { KEY_TRNS, KEY_TRNS, KEY_PAGEUP, KEY_PAGEDOWN, KEY_TRNS },
+        { KEY_TRNS, KEY_TRNS, KEY_HOME, KEY_LEFT, KEY_TRNS },
+        { KEY_TRNS, KEY_TRNS, KEY_UP, KEY_DOWN, KEY_TRNS },
+        { KEY_TRNS, KEY_TRNS, KEY_END, KEY_RIGHT, KEY_TRNS },
+        { KEY_TRNS, KEY_TRNS, KEY_SYSRQ, KEY_TRNS, KEY_TRNS },
+        { KEY_TRNS, KEY_TRNS, KEY_INSERT, KEY_TRNS, KEY_TRNS },
+    },
+};
+
+/*
+** The built-in keymap stays in flash and only the entries changed over USB
+** are kept in SRAM. keymap_present has a bit per layer and position that is
+** set when the entry is overridden, and the keycodes of those entries sit in
+** keymap_override in layer and position order. keymap_rank holds how many
+** overrides come before each bitmap byte, so an override is found with one
+** bitmap byte and one population count whatever the table holds.
+**
+** EEPROM holds the whole keymap as the scan loop sees it: changed entries are
+** marked in keymap_dirty and written back by keymap_task() once no change has
+** come in for KEYMAP_PERSIST_MS, one byte each however the table shifts.
+*/
+#define KEYMAP_POSITIONS (COLUMN_COUNT * ROW_COUNT)
+#define KEYMAP_MAP_BYTES ((KEYMAP_POSITIONS + 7) / 8)
+#define KEYMAP_EEPROM_MAGIC (0xA0 | LAYER_COUNT)
+#define KEYMAP_PERSIST_RUNS (KEYMAP_PERSIST_MS / 4)
+static_assert(KEYMAP_POSITIONS <= 0xFF);
+
+static uint8_t keymap_present[LAYER_COUNT][KEYMAP_MAP_BYTES] = { { 0, }, };
+static uint8_t keymap_rank[LAYER_COUNT][KEYMAP_MAP_BYTES] = { { 0, }, };
+static uint8_t keymap_override[KEYMAP_OVERRIDES];
+static uint8_t keymap_overrides = 0; /* entries in use */
+
+static uint8_t keymap_eeprom[LAYER_COUNT][KEYMAP_POSITIONS] EEMEM;
+static uint8_t keymap_eeprom_magic EEMEM;
+
+static volatile uint8_t keymap_dirty[LAYER_COUNT * KEYMAP_MAP_BYTES] = { 0, };
+static volatile uint8_t keymap_quiet = 0; /* keymap_task() runs left before writing */
+static bool keymap_formatted = false; /* EEPROM holds a whole keymap */
+static bool keymap_formatting = false; /* laying one down on a blank EEPROM */
+static uint8_t keymap_cursor = 0; /* next entry keymap_task() looks at */
+
+/* Active layers, bit n for layer n. The base layer is always active. */
+uint8_t keymap_layers = 0x01;
+static uint8_t keymap_top = 0; /* highest active layer */
+
+/* Layer each held key was pressed on, bit n of plane k is bit k of the layer of row n */
+#define LAYER_BITS (LAYER_COUNT > 4 ? 3 : LAYER_COUNT > 2 ? 2 : 1)
+static uint8_t keymap_bound[LAYER_BITS][COLUMN_COUNT] = { { 0, }, };
+
+static uint8_t keymap_built_in(uint8_t layer, uint8_t position) {
+    return pgm_read_byte(&keymap_default[layer][0][0] + position);
+}
+
+/* Index in keymap_override the entry has, or would have once inserted */
+static uint8_t keymap_index(uint8_t layer, uint8_t position) {
+    uint8_t below = _BV(position % 8) - 1;
+    return keymap_rank[layer][position / 8] + __builtin_popcount(keymap_present[layer][position / 8] & below);
+}
+
+/* Recount the overrides before every bitmap byte, after one was added or removed */
+static void keymap_reindex(void) {
+    uint8_t rank = 0;
+    for (uint8_t layer = 0; layer < LAYER_COUNT; ++layer) {
+        for (uint8_t i = 0; i < KEYMAP_MAP_BYTES; ++i) {
+            keymap_rank[layer][i] = rank;
+            rank += __builtin_popcount(keymap_present[layer][i]);
+        }
+    }
+}
+
+/* Atomic against keymap_set(), which shifts the table from the control endpoint */
+static uint8_t keymap_entry(uint8_t layer, uint8_t position) {
+    uint8_t keycode;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (keymap_present[layer][position / 8] & _BV(position % 8)) {
+            keycode = keymap_override[keymap_index(layer, position)];
+        } else {
+            keycode = keymap_built_in(layer, position);
+        }
+    }
+    return keycode;
+}
+
+static uint8_t keymap_read(uint8_t layer, uint8_t column, uint8_t row) {
+    uint8_t position = column * ROW_COUNT + row;
+    uint8_t keycode = keymap_entry(layer, position);
+    if (keycode == KEY_TRANSPARENT) {
+        keycode = keymap_entry(0, position);
+    }
+    return keycode;
+}
+
+/*
+** Take the entries that differ from flash when EEPROM holds a keymap of this
+** geometry. They come in table order, so each one is appended. Any past
+** KEYMAP_OVERRIDES, from a build with a larger table, fall back to flash.
+*/
+void keymap_init(void) {
+    for (uint8_t layer = 0; layer < LAYER_COUNT; ++layer) {
+        for (uint8_t i = 0; i < KEYMAP_MAP_BYTES; ++i) {
+            keymap_present[layer][i] = 0x00;
+        }
+    }
+    keymap_overrides = 0;
+    keymap_formatted = eeprom_read_byte(&keymap_eeprom_magic) == KEYMAP_EEPROM_MAGIC;
+    for (uint8_t layer = 0; keymap_formatted && layer < LAYER_COUNT; ++layer) {
+        for (uint8_t position = 0; position < KEYMAP_POSITIONS; ++position) {
+            uint8_t keycode = eeprom_read_byte(&keymap_eeprom[layer][position]);
+            if (keycode != keymap_built_in(layer, position) && keymap_overrides < KEYMAP_OVERRIDES) {
+                keymap_override[keymap_overrides++] = keycode;
+                keymap_present[layer][position / 8] |= _BV(position % 8);
+            }
+        }
+    }
+    keymap_reindex();
+}
+
+bool keymap_get(uint8_t layer, uint8_t column, uint8_t row, uint8_t *keycode) {
+    if (layer >= LAYER_COUNT || column >= COLUMN_COUNT || row >= ROW_COUNT) {
+        return false;
+    }
+    *keycode = keymap_entry(layer, column * ROW_COUNT + row);
+    return true;
+}
+
+uint8_t keymap_free(void) {
+    return KEYMAP_OVERRIDES - keymap_overrides;
+}
+
+static void keymap_mark(uint8_t layer, uint8_t position) {
+    keymap_dirty[layer * KEYMAP_MAP_BYTES + position / 8] |= _BV(position % 8);
+    keymap_quiet = KEYMAP_PERSIST_RUNS;
+}
+
+/*
+** Called from the control endpoint. Writing the built-in keycode removes the
+** override, any other keycode takes one, which fails once all
+** KEYMAP_OVERRIDES are taken. A key held while its entry changes is released
+** under the new keycode, so remap between keystrokes.
+*/
+bool keymap_set(uint8_t layer, uint8_t column, uint8_t row, uint8_t keycode) {
+    if (layer >= LAYER_COUNT || column >= COLUMN_COUNT || row >= ROW_COUNT) {
+        return false;
+    }
+    uint8_t position = column * ROW_COUNT + row;
+    uint8_t *present = &keymap_present[layer][position / 8];
+    uint8_t bit = _BV(position % 8);
+    bool built_in = keymap_built_in(layer, position) == keycode;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint8_t index = keymap_index(layer, position);
+        if (*present & bit) {
+            if (built_in) {
+                for (uint8_t i = index + 1; i < keymap_overrides; ++i) {
+                    keymap_override[i - 1] = keymap_override[i];
+                }
+                --keymap_overrides;
+                *present &= ~bit;
+                keymap_reindex();
+                keymap_mark(layer, position);
+            } else if (keymap_override[index] != keycode) {
+                keymap_override[index] = keycode;
+                keymap_mark(layer, position);
+            }
+        } else if (!built_in) {
+            if (keymap_overrides == KEYMAP_OVERRIDES) {
+                return false;
+            }
+            for (uint8_t i = keymap_overrides; i > index; --i) {
+                keymap_override[i] = keymap_override[i - 1];
+            }
+            keymap_override[index] = keycode;
+            ++keymap_overrides;
+            *present |= bit;
+            keymap_reindex();
+            keymap_mark(layer, position);
+        }
+    }
+    return true;
+}
+
+void keymap_reset(void) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        for (uint8_t layer = 0; layer < LAYER_COUNT; ++layer) {
+            for (uint8_t i = 0; i < KEYMAP_MAP_BYTES; ++i) {
+                if (keymap_present[layer][i]) {
+                    keymap_dirty[layer * KEYMAP_MAP_BYTES + i] |= keymap_present[layer][i];
+                    keymap_quiet = KEYMAP_PERSIST_RUNS;
+                    keymap_present[layer][i] = 0x00;
+                }
+            }
+        }
+        keymap_overrides = 0;
+        keymap_reindex();
+    }
+}
+
+/*
+** Scheduler job writing back dirty entries, at most one EEPROM write per run
+** so that the scan loop never waits on the EEPROM. eeprom_update_byte()
+** skips bytes that already hold the value. On a blank EEPROM the whole
+** keymap is laid down and the magic byte goes last, so a keymap cut short by
+** a reset is not taken at the next boot.
+*/
+void keymap_task(void) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (keymap_quiet) {
+            keymap_quiet = keymap_quiet - 1;
+            return;
+        }
+    }
+    if (!eeprom_is_ready()) {
+        return;
+    }
+    for (uint8_t n = 0; n < sizeof(keymap_dirty); ++n, ++keymap_cursor) {
+        if (keymap_cursor == sizeof(keymap_dirty)) {
+            keymap_cursor = 0;
+        }
+        uint8_t bits = keymap_dirty[keymap_cursor];
+        if (bits == 0x00) {
+            continue;
+        }
+        if (!keymap_formatted && !keymap_formatting) {
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                for (uint8_t i = 0; i < KEYMAP_POSITIONS; ++i) {
+                    for (uint8_t layer = 0; layer < LAYER_COUNT; ++layer) {
+                        keymap_dirty[layer * KEYMAP_MAP_BYTES + i / 8] |= _BV(i % 8);
+                    }
+                }
+            }
+            keymap_formatting = true;
+            bits = keymap_dirty[keymap_cursor];
+        }
+        uint8_t bit = 0;
+        while (!(bits & _BV(bit))) {
+            ++bit;
+        }
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            keymap_dirty[keymap_cursor] &= ~_BV(bit);
+        }
+        uint8_t layer = keymap_cursor / KEYMAP_MAP_BYTES;
+        uint8_t position = keymap_cursor % KEYMAP_MAP_BYTES * 8 + bit;
+        eeprom_update_byte(&keymap_eeprom[layer][position], keymap_entry(layer, position));
+        return;
+    }
+    if (keymap_formatting) {
+        eeprom_update_byte(&keymap_eeprom_magic, KEYMAP_EEPROM_MAGIC);
+        keymap_formatting = false;
+        keymap_formatted = true;
+    }
+}
+
+static void keymap_set_layers(uint8_t layers) {
+    keymap_layers = layers | 0x01;
+    keymap_top = 0;
+    for (uint8_t layer = LAYER_COUNT - 1; layer > 0; --layer) {
+        if (keymap_layers & _BV(layer)) {
+            keymap_top = layer;
+            break;
+        }
+    }
+}
+
+/* Resolve a newly pressed key against the active layers and remember the layer */
+uint8_t keymap_press(uint8_t column, uint8_t row) {
+    uint8_t layer = keymap_top;
+    for (uint8_t k = 0; k < LAYER_BITS; ++k) {
+        if (layer & _BV(k)) {
+            keymap_bound[k][column] |= _BV(row);
+        } else {
+            keymap_bound[k][column] &= ~_BV(row);
+        }
+    }
+
+    uint8_t keycode = keymap_read(layer, column, row);
+    if (IS_LAYER_MO(keycode)) {
+        keymap_set_layers(keymap_layers | _BV(keycode - LAYER_MO(0)));
+        return KEY_NONE;
+    }
+    if (IS_LAYER_TG(keycode)) {
+        keymap_set_layers(keymap_layers ^ _BV(keycode - LAYER_TG(0)));
+        return KEY_NONE;
+    }
+    return keycode;
+}
+
+/* Keycode of a released key, looked up on the layer it was pressed on */
+uint8_t keymap_release(uint8_t column, uint8_t row) {
+    uint8_t layer = 0;
+    for (uint8_t k = 0; k < LAYER_BITS; ++k) {
+        if (keymap_bound[k][column] & _BV(row)) {
+            layer |= _BV(k);
+        }
+    }
+
+    uint8_t keycode = keymap_read(layer, column, row);
+    if (IS_LAYER_MO(keycode)) {
+        keymap_set_layers(keymap_layers & ~_BV(keycode - LAYER_MO(0)));
+        return KEY_NONE;
+    }
+    if (IS_LAYER_TG(keycode)) {
+        return KEY_NONE;
+    }
+    return keycode;
+}
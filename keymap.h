@@ -0,0 +1,67 @@
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+#include <stdint.h>
+#include "matrix.h"
+#include "scheduler.h"
+
+#define LAYER_COUNT 2
+static_assert(LAYER_COUNT >= 1 && LAYER_COUNT <= 8);
+
+/*
+** Firmware keycodes, taken from 0xB0-0xDF which the report descriptor does
+** not cover, so they never reach the host.
+*/
+#define KEY_TRANSPARENT 0xB0 /* use the base layer entry */
+#define KEY_TRNS KEY_TRANSPARENT
+#define LAYER_MO(n) (0xC0 + (n)) /* layer n while held */
+#define LAYER_TG(n) (0xC8 + (n)) /* toggle layer n */
+/* 0xB8-0xBF are TAPHOLD(n), see taphold.h, and 0xD0-0xDF are MACRO(n), see macro.h */
+
+#define IS_LAYER_MO(keycode) ((keycode) >= 0xC0 && (keycode) <= 0xC7)
+#define IS_LAYER_TG(keycode) ((keycode) >= 0xC8 && (keycode) <= 0xCF)
+
+/*
+** Vendor requests on EP0 to the device. The entry is addressed by
+** wValueH = layer, wValueL = column and wIndexL = row. GET_KEY returns the
+** keycode in a one byte data stage, SET_KEY takes it in wIndexH and has no
+** data stage, RESET_KEYS restores the built-in keymap. SET_KEY stalls when
+** the entry would need an override and none is free, GET_FREE returns how
+** many are left in a one byte data stage.
+*/
+#define KEYMAP_REQUEST_GET_KEY 0x01
+#define KEYMAP_REQUEST_SET_KEY 0x02
+#define KEYMAP_REQUEST_RESET_KEYS 0x03
+#define KEYMAP_REQUEST_GET_FREE 0x04
+
+/*
+** Entries that can differ from the built-in keymap at once, a byte of SRAM
+** each on top of two bitmaps of LAYER_COUNT * 9 bytes. The whole keymap in
+** SRAM would take LAYER_COUNT * 70.
+*/
+#ifndef KEYMAP_OVERRIDES
+#define KEYMAP_OVERRIDES 32
+#endif
+static_assert(KEYMAP_OVERRIDES >= 1 && KEYMAP_OVERRIDES <= 0xFF);
+static_assert(KEYMAP_OVERRIDES <= LAYER_COUNT * COLUMN_COUNT * ROW_COUNT);
+
+/* Quiet time after the last change before it goes to EEPROM */
+#ifndef KEYMAP_PERSIST_MS
+#define KEYMAP_PERSIST_MS 1000
+#endif
+/* keymap_task() period, at least one EEPROM byte write (3.4 ms) */
+#define KEYMAP_TASK_PERIOD SCHEDULER_MS(4)
+static_assert(KEYMAP_PERSIST_MS / 4 >= 1 && KEYMAP_PERSIST_MS / 4 <= 0xFF);
+
+extern uint8_t keymap_layers;
+
+void keymap_init(void);
+bool keymap_get(uint8_t layer, uint8_t column, uint8_t row, uint8_t *keycode);
+bool keymap_set(uint8_t layer, uint8_t column, uint8_t row, uint8_t keycode);
+void keymap_reset(void);
+uint8_t keymap_free(void);
+void keymap_task(void);
+uint8_t keymap_press(uint8_t column, uint8_t row);
+uint8_t keymap_release(uint8_t column, uint8_t row);
+
+#endif
@@ -0,0 +1,217 @@
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+#include "link.h"
+#include "matrix.h"
+#include "idle.h"
+#include "utility.h"
+
+#if LINK_ENABLE
+
+#define BAUD USART_BAUDRATE
+#include <util/setbaud.h>
+
+/* Transmit ring, power of two and at least one full frame */
+#define LINK_TX_SIZE 32
+static_assert(LINK_TX_SIZE >= LINK_FRAME_MAX);
+static_assert((LINK_TX_SIZE & (LINK_TX_SIZE - 1)) == 0);
+
+volatile uint16_t link_frames = 0;
+volatile uint16_t link_errors = 0;
+volatile uint16_t link_gaps = 0;
+
+/* Indices run freely, head is only written by link_send(), tail by the UDRE interrupt */
+static uint8_t link_tx[LINK_TX_SIZE];
+static volatile uint8_t link_tx_head = 0;
+static volatile uint8_t link_tx_tail = 0;
+static uint8_t link_sent[COLUMN_COUNT] = { 0, };
+static uint8_t link_sequence = 0;
+static uint16_t link_refresh = 1;
+
+static uint8_t link_rx[LINK_FRAME_MAX];
+static uint8_t link_rx_length = 0; /* 0 while hunting for LINK_SYNC */
+static volatile uint8_t link_rx_quiet = 0; /* scans since the last byte */
+static uint8_t link_rx_expected = LINK_FRAME_MAX;
+static uint8_t link_rx_crc = 0;
+static uint8_t link_rx_sequence = 0;
+static bool link_rx_synced = false;
+
+/* Written by the receive interrupt, read under ATOMIC_BLOCK by link_merge() */
+static uint8_t link_remote[COLUMN_COUNT] = { 0, };
+static volatile uint16_t link_silence = 0; /* scans since the last good frame */
+static uint8_t link_merged[COLUMN_COUNT];
+
+static uint8_t link_columns(uint16_t mask) {
+    uint8_t count = 0;
+    for (; mask; mask >>= 1) {
+        count += mask & 0x01;
+    }
+    return count;
+}
+
+void link_init(void) {
+    UBRR1 = UBRR_VALUE;
+#if USE_2X
+    UCSR1A = _BV(U2X1);
+#else
+    UCSR1A = 0x00;
+#endif
+    UCSR1C = _BV(UCSZ11) | _BV(UCSZ10); /* 8N1 */
+    UCSR1B = _BV(RXCIE1) | _BV(RXEN1) | _BV(TXEN1);
+}
+
+ISR(USART1_UDRE_vect, ISR_BLOCK) {
+    if (link_tx_tail == link_tx_head) {
+        UCSR1B &= ~_BV(UDRIE1);
+        return;
+    }
+    UDR1 = link_tx[link_tx_tail & (LINK_TX_SIZE - 1)];
+    link_tx_tail = link_tx_tail + 1;
+}
+
+/*
+** Queue a frame with every column that changed since the last one, or all
+** of them when a refresh is due. Runs once per scan; when the ring has no
+** room for the frame the change stays pending and goes out with the next.
+*/
+void link_send(const uint8_t local[COLUMN_COUNT]) {
+    bool refresh = --link_refresh == 0;
+    uint16_t mask = 0x0000;
+    for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+        if (refresh || local[i] != link_sent[i]) {
+            mask |= 1 << i;
+        }
+    }
+    if (mask == 0x0000) {
+        return;
+    }
+    uint8_t length = LINK_HEADER_SIZE + link_columns(mask) + 1;
+    uint8_t head = link_tx_head;
+    if ((uint8_t)(LINK_TX_SIZE - (uint8_t)(head - link_tx_tail)) < length) {
+        if (refresh) {
+            link_refresh = 1;
+        }
+        return;
+    }
+    if (refresh) {
+        link_refresh = LINK_REFRESH;
+    }
+
+    uint8_t header[LINK_HEADER_SIZE] = { LINK_SYNC, link_sequence++, mask & 0xFF, mask >> 8 };
+    uint8_t crc = 0x00;
+    for (uint8_t i = 0; i < LINK_HEADER_SIZE; ++i) {
+        if (i) {
+            crc = _crc8_ccitt_update(crc, header[i]);
+        }
+        link_tx[head++ & (LINK_TX_SIZE - 1)] = header[i];
+    }
+    for (uint8_t i = 0; mask; ++i, mask >>= 1) {
+        if (mask & 0x01) {
+            link_sent[i] = local[i];
+            crc = _crc8_ccitt_update(crc, local[i]);
+            link_tx[head++ & (LINK_TX_SIZE - 1)] = local[i];
+        }
+    }
+    link_tx[head++ & (LINK_TX_SIZE - 1)] = crc;
+    COMPILER_BARRIER;
+    link_tx_head = head;
+    UCSR1B |= _BV(UDRIE1);
+}
+
+/* Take a frame whose CRC checked out */
+static void link_apply(void) {
+    uint8_t sequence = link_rx[1];
+    if (link_rx_synced) {
+        link_gaps += (uint8_t)(sequence - link_rx_sequence);
+    }
+    link_rx_synced = true;
+    link_rx_sequence = sequence + 1;
+
+    bool changed = false;
+    const uint8_t *row = link_rx + LINK_HEADER_SIZE;
+    uint16_t mask = link_rx[2] | link_rx[3] << 8;
+    for (uint8_t i = 0; mask; ++i, mask >>= 1) {
+        if (mask & 0x01) {
+            uint8_t state = *row++ & (_BV(ROW_COUNT) - 1);
+            changed |= state != link_remote[i];
+            link_remote[i] = state;
+        }
+    }
+    link_silence = 0;
+    ++link_frames;
+    if (changed) {
+        idle_wake(); /* a parked scanner would not merge them */
+    }
+}
+
+/* One byte at a time, the CRC is kept running so the last byte costs no more than the rest */
+ISR(USART1_RX_vect, ISR_BLOCK) {
+    bool error = UCSR1A & (_BV(FE1) | _BV(DOR1)); /* valid until UDR1 is read */
+    uint8_t byte = UDR1;
+    link_rx_quiet = 0;
+    if (error) {
+        if (link_rx_length) {
+            ++link_errors;
+        }
+        link_rx_length = 0;
+        return;
+    }
+    if (link_rx_length == 0) {
+        if (byte == LINK_SYNC) {
+            link_rx[link_rx_length++] = byte;
+            link_rx_crc = 0x00;
+        }
+        return;
+    }
+    link_rx[link_rx_length++] = byte;
+    link_rx_crc = _crc8_ccitt_update(link_rx_crc, byte);
+    if (link_rx_length == LINK_HEADER_SIZE) {
+        uint16_t mask = link_rx[2] | link_rx[3] << 8;
+        if (mask >> COLUMN_COUNT) {
+            ++link_errors;
+            link_rx_length = 0;
+            return;
+        }
+        link_rx_expected = LINK_HEADER_SIZE + link_columns(mask) + 1;
+    }
+    if (link_rx_length < LINK_HEADER_SIZE || link_rx_length < link_rx_expected) {
+        return;
+    }
+    link_rx_length = 0;
+    if (link_rx_crc != 0x00) { /* running CRC over data and CRC byte */
+        ++link_errors;
+        return;
+    }
+    link_apply();
+}
+
+/*
+** Local and remote keys for this scan. Remote keys are dropped when the
+** other end went quiet, so unplugging it mid-press cannot leave them stuck.
+** A frame goes out back to back, so one still incomplete after two scans
+** without a byte was cut short and is given up.
+*/
+const uint8_t *link_merge(const uint8_t local[COLUMN_COUNT]) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (link_rx_length && ++link_rx_quiet >= 2) {
+            link_rx_length = 0;
+            ++link_errors;
+        }
+        if (link_silence < LINK_TIMEOUT) {
+            link_silence = link_silence + 1;
+        } else {
+            for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+                link_remote[i] = 0x00;
+            }
+            link_rx_synced = false;
+        }
+        for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+            link_merged[i] = local[i] | link_remote[i];
+        }
+    }
+    return link_merged;
+}
+
+#endif
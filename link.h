@@ -0,0 +1,67 @@
+#ifndef LINK_H
+#define LINK_H
+
+#include <stdint.h>
+#include "matrix.h"
+#include "scheduler.h"
+
+/*
+** Key matrix link to a second half or a macro pad over USART1.
+**
+** Both ends run the same firmware and share the COLUMN_COUNT x ROW_COUNT
+** grid, each populating the positions it has switches for. Every scan sends
+** the columns whose debounced state changed since the last frame, and the
+** received columns are OR-merged with the local ones before report_update(),
+** so remote keys go through the keymap, tap-hold and report queue like local
+** ones.
+**
+** USART1 is on PD2 (RXD1) and PD3 (TXD1), which this PCB uses for rows 3 and
+** 4. With LINK_ENABLE set those two rows drop out of the local matrix: the
+** scan never drives them and masks them out, so their 28 keys are dead on
+** this board and only the other end can supply keys at those positions.
+*/
+#ifndef LINK_ENABLE
+#define LINK_ENABLE 0
+#endif
+
+#ifndef USART_BAUDRATE
+#define USART_BAUDRATE 1000000
+#endif
+
+/*
+** Frame, all bytes but the first covered by the CRC:
+** sync, sequence, column mask (2 bytes, little endian), one row byte per
+** column in the mask in column order, CRC-8 (polynomial 0x07).
+*/
+#define LINK_SYNC 0xD5
+#define LINK_HEADER_SIZE 4
+#define LINK_FRAME_MAX (LINK_HEADER_SIZE + COLUMN_COUNT + 1)
+static_assert(COLUMN_COUNT <= 16);
+
+/* A full frame every LINK_REFRESH scans resyncs a receiver that lost one */
+#define LINK_REFRESH SCHEDULER_MS(64)
+/* Remote keys are released when no frame arrived for this many scans */
+#define LINK_TIMEOUT (4 * LINK_REFRESH)
+
+#if LINK_ENABLE
+
+/* The largest frame has to be on the wire within one scan period, 10 bits a byte */
+static_assert((uint32_t)LINK_FRAME_MAX * 10 * SCAN_RATE_HZ <= USART_BAUDRATE);
+
+extern volatile uint16_t link_frames;
+extern volatile uint16_t link_errors; /* CRC or framing errors */
+extern volatile uint16_t link_gaps; /* sequence numbers skipped */
+
+void link_init(void);
+void link_send(const uint8_t local[COLUMN_COUNT]);
+const uint8_t *link_merge(const uint8_t local[COLUMN_COUNT]);
+
+#else
+
+#define link_init() ((void)0)
+#define link_send(local) ((void)(local))
+#define link_merge(local) (local)
+
+#endif
+
+#endif
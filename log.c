@@ -0,0 +1,171 @@
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include "log.h"
+#include "link.h"
+#include "utility.h"
+
+#if LOG_ENABLE
+
+static_assert(!LINK_ENABLE); /* both own USART1 */
+
+#define BAUD USART_BAUDRATE
+#include <util/setbaud.h>
+
+volatile uint16_t log_dropped = 0;
+
+typedef struct {
+    const char *format; /* in flash */
+    uint32_t args[LOG_ARGS];
+} log_entry_t;
+
+/* Indices run freely, queue head is advanced by log_queue_P(), queue tail by log_task() */
+static log_entry_t log_queue[LOG_QUEUE_DEPTH];
+static volatile uint8_t log_queue_head = 0;
+static volatile uint8_t log_queue_tail = 0;
+
+/* Head is only written by log_task(), tail by the UDRE interrupt */
+static char log_buffer[LOG_BUFFER_SIZE];
+static volatile uint8_t log_head = 0;
+static volatile uint8_t log_tail = 0;
+
+void log_init(void) {
+    UBRR1 = UBRR_VALUE;
+#if USE_2X
+    UCSR1A = _BV(U2X1);
+#else
+    UCSR1A = 0x00;
+#endif
+    UCSR1C = _BV(UCSZ11) | _BV(UCSZ10); /* 8N1 */
+    UCSR1B = _BV(TXEN1);
+}
+
+ISR(USART1_UDRE_vect, ISR_BLOCK) {
+    if (log_tail == log_head) {
+        UCSR1B &= ~_BV(UDRIE1);
+        return;
+    }
+    UDR1 = log_buffer[log_tail & (LOG_BUFFER_SIZE - 1)];
+    log_tail = log_tail + 1;
+}
+
+/* Only a copy, the atomic block keeps lines from interrupt handlers whole */
+void log_queue_P(const char *format, uint32_t first, uint32_t second) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint8_t head = log_queue_head;
+        if ((uint8_t)(head - log_queue_tail) == LOG_QUEUE_DEPTH) {
+            ++log_dropped;
+        } else {
+            log_entry_t *entry = &log_queue[head & (LOG_QUEUE_DEPTH - 1)];
+            entry->format = format;
+            entry->args[0] = first;
+            entry->args[1] = second;
+            log_queue_head = head + 1;
+        }
+    }
+}
+
+/* Digits of value, most significant first, returns how many */
+static uint8_t log_number(char *out, uint32_t value, uint8_t base) {
+    char digits[10];
+    uint8_t count = 0;
+    do {
+        uint8_t digit = value % base;
+        digits[count++] = digit < 10 ? '0' + digit : 'a' + digit - 10;
+        value /= base;
+    } while (value);
+    for (uint8_t i = 0; i < count; ++i) {
+        out[i] = digits[count - 1 - i];
+    }
+    return count;
+}
+
+/* Format into line, which holds LOG_LINE_MAX, returns the length */
+static uint8_t log_format(char *line, const log_entry_t *entry) {
+    const char *format = entry->format;
+    uint8_t arg = 0;
+    uint8_t length = 0;
+    char c;
+    while ((c = pgm_read_byte(format++)) != '\0') {
+        char number[11];
+        uint8_t count = 0;
+        if (c != '%') {
+            number[0] = c;
+            count = 1;
+        } else {
+            bool wide = false;
+            c = pgm_read_byte(format++);
+            if (c == 'l') {
+                wide = true;
+                c = pgm_read_byte(format++);
+            }
+            uint32_t value = 0;
+            if (c == 'c' || c == 'd' || c == 'u' || c == 'x') {
+                value = arg < LOG_ARGS ? entry->args[arg++] : 0;
+                if (!wide) {
+                    value = c == 'd' ? (uint32_t)(int32_t)(int16_t)value : (uint16_t)value;
+                }
+            }
+            switch (c) {
+                case 'c':
+                    number[0] = value;
+                    count = 1;
+                    break;
+                case 'd':
+                    if ((int32_t)value < 0) {
+                        number[count++] = '-';
+                        value = -value;
+                    }
+                    count += log_number(number + count, value, 10);
+                    break;
+                case 'u':
+                case 'x':
+                    count = log_number(number, value, c == 'x' ? 16 : 10);
+                    break;
+                case '\0':
+                    --format; /* lone % at the end */
+                    break;
+                default:
+                    number[0] = c;
+                    count = 1;
+                    break;
+            }
+        }
+        for (uint8_t i = 0; i < count && length < LOG_LINE_MAX - 1; ++i) {
+            line[length++] = number[i];
+        }
+    }
+    if (length == LOG_LINE_MAX - 1 && line[length - 1] != '\n') {
+        line[length++] = '\n';
+    }
+    return length;
+}
+
+/*
+** Formats the oldest queued line once the ring has room for the longest
+** one, so the divisions run here in the main loop and never in the handler
+** that logged. One line a run keeps the job short.
+*/
+void log_task(void) {
+    uint8_t tail = log_queue_tail;
+    if (tail == log_queue_head) {
+        return;
+    }
+    uint8_t head = log_head;
+    if ((uint8_t)(LOG_BUFFER_SIZE - (uint8_t)(head - log_tail)) < LOG_LINE_MAX) {
+        return;
+    }
+    char line[LOG_LINE_MAX];
+    uint8_t length = log_format(line, &log_queue[tail & (LOG_QUEUE_DEPTH - 1)]);
+    log_queue_tail = tail + 1;
+    for (uint8_t i = 0; i < length; ++i) {
+        log_buffer[head++ & (LOG_BUFFER_SIZE - 1)] = line[i];
+    }
+    COMPILER_BARRIER;
+    log_head = head;
+    UCSR1B |= _BV(UDRIE1);
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+/*
+** Debug log on TXD1 at USART_BAUDRATE, 8N1. LOG() only queues the flash
+** format string and the raw argument values, which is cheap enough for
+** interrupt handlers. log_task() formats the queued lines from the main loop
+** into a ring that the UDRE interrupt drains, so nothing ever waits for the
+** wire. A line that finds the queue full is dropped and counted in
+** log_dropped.
+**
+** Format strings stay in flash. Conversions are %c, %d, %u, %x, the same
+** with an l prefix for 32 bit values, and %%, with at most LOG_ARGS
+** arguments. They are formatted later than LOG() runs, so there is no %s.
+**
+** TXD1 is PD3, row 4 on this PCB. With LOG_ENABLE set the row drops out of
+** the local matrix like with LINK_ENABLE, so its 14 keys are dead. USART1 is
+** also the one the key matrix link uses, so the two cannot be enabled
+** together.
+*/
+#ifndef LOG_ENABLE
+#define LOG_ENABLE 0
+#endif
+
+/* Longest line, newline included, the rest is cut off */
+#define LOG_LINE_MAX 48
+
+/* Ring size, power of two */
+#ifndef LOG_BUFFER_SIZE
+#define LOG_BUFFER_SIZE 128
+#endif
+static_assert(LOG_BUFFER_SIZE >= LOG_LINE_MAX && LOG_BUFFER_SIZE <= 128);
+static_assert((LOG_BUFFER_SIZE & (LOG_BUFFER_SIZE - 1)) == 0);
+
+/* Lines waiting for log_task(), power of two */
+#ifndef LOG_QUEUE_DEPTH
+#define LOG_QUEUE_DEPTH 8
+#endif
+static_assert(LOG_QUEUE_DEPTH <= 128);
+static_assert((LOG_QUEUE_DEPTH & (LOG_QUEUE_DEPTH - 1)) == 0);
+
+#define LOG_ARGS 2
+
+#if LOG_ENABLE
+
+extern volatile uint16_t log_dropped;
+
+void log_init(void);
+void log_queue_P(const char *format, uint32_t first, uint32_t second);
+void log_task(void);
+
+/* The trailing zeros fill in unused arguments without __VA_OPT__ */
+#define LOG(...) LOG_LINE(__VA_ARGS__, 0, 0, 0)
+#define LOG_LINE(format, first, second, ...) \
+    log_queue_P(PSTR(format "\n"), (uint32_t)(first), (uint32_t)(second))
+
+#else
+
+#define log_init() ((void)0)
+#define log_task() ((void)0)
+#define LOG(...) ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "macro.h"
+#include "usb_hid_keys.h"
+
+static const uint8_t macro_0[] PROGMEM = {
+    MACRO_DOWN(KEY_LEFTSHIFT), MACRO_TAP(KEY_T), MACRO_UP(KEY_LEFTSHIFT),
+    MACRO_TAP(KEY_H), MACRO_TAP(KEY_E),
+    MACRO_DOWN(KEY_LEFTSHIFT), MACRO_TAP(KEY_F), MACRO_UP(KEY_LEFTSHIFT),
+    MACRO_TAP(KEY_I), MACRO_TAP(KEY_R), MACRO_TAP(KEY_S), MACRO_TAP(KEY_T),
+    MACRO_DOWN(KEY_LEFTSHIFT), MACRO_TAP(KEY_K), MACRO_UP(KEY_LEFTSHIFT),
+    MACRO_TAP(KEY_E), MACRO_TAP(KEY_Y), MACRO_TAP(KEY_B), MACRO_TAP(KEY_O),
+    MACRO_TAP(KEY_A), MACRO_TAP(KEY_R), MACRO_TAP(KEY_D),
+    MACRO_END,
+};
+
+static const uint8_t * const macros[MACRO_COUNT] PROGMEM = {
+    [0] = macro_0,
+};
+
+static const uint8_t *macro_cursor = NULL; /* next opcode, NULL when stopped */
+static uint8_t macro_wait = 0; /* ticks left of a MACRO_WAIT */
+
+/* Start a macro, a trigger while one is playing is ignored */
+void macro_play(uint8_t index) {
+    if (index >= MACRO_COUNT || macro_cursor != NULL) {
+        return;
+    }
+    macro_cursor = pgm_read_ptr(&macros[index]);
+    macro_wait = 0;
+}
+
+bool macro_playing(void) {
+    return macro_cursor != NULL;
+}
+
+/*
+** Called once per scan. Returns the next key change of the playing macro, or
+** KEY_NONE while waiting out a delay or when the report queue is not ready
+** for another step. Delays count scans whether or not the queue is ready.
+*/
+uint8_t macro_next(bool ready, bool *pressed) {
+    if (macro_cursor == NULL) {
+        return KEY_NONE;
+    }
+    if (macro_wait) {
+        --macro_wait;
+        return KEY_NONE;
+    }
+    if (!ready) {
+        return KEY_NONE;
+    }
+
+    uint8_t op = pgm_read_byte(macro_cursor++);
+    switch (op) {
+        case MACRO_OP_DOWN:
+        case MACRO_OP_UP:
+            *pressed = op == MACRO_OP_DOWN;
+            return pgm_read_byte(macro_cursor++);
+        case MACRO_OP_WAIT:
+            macro_wait = pgm_read_byte(macro_cursor++);
+            return KEY_NONE;
+        default:
+            macro_cursor = NULL;
+            return KEY_NONE;
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef MACRO_H
+#define MACRO_H
+
+#include <stdint.h>
+#include "scheduler.h"
+
+/*
+** Macros are byte strings in flash, played one step per report so that every
+** press and release reaches the host in its own report. MACRO(n) keycodes
+** share the firmware range 0xB0-0xDF with the layer keys.
+*/
+#define MACRO_COUNT 1
+static_assert(MACRO_COUNT >= 1 && MACRO_COUNT <= 16);
+
+#define MACRO(n) (0xD0 + (n)) /* play macro n on press */
+#define IS_MACRO(keycode) ((keycode) >= 0xD0 && (keycode) <= 0xDF)
+
+/* Opcodes of the byte string */
+#define MACRO_OP_END 0x00
+#define MACRO_OP_DOWN 0x01
+#define MACRO_OP_UP 0x02
+#define MACRO_OP_WAIT 0x03
+
+#define MACRO_DOWN(keycode) MACRO_OP_DOWN, (keycode)
+#define MACRO_UP(keycode) MACRO_OP_UP, (keycode)
+#define MACRO_TAP(keycode) MACRO_DOWN(keycode), MACRO_UP(keycode)
+#define MACRO_WAIT(ms) MACRO_OP_WAIT, (SCHEDULER_MS(ms) > 0xFF ? 0xFF : SCHEDULER_MS(ms))
+#define MACRO_END MACRO_OP_END
+
+/*
+** Reports allowed in the queue before the next step. Two keeps one report
+** ready behind the one the host takes next, so a step goes out every poll.
+*/
+#ifndef MACRO_QUEUE_TARGET
+#define MACRO_QUEUE_TARGET 2
+#endif
+
+void macro_play(uint8_t index);
+bool macro_playing(void);
+uint8_t macro_next(bool ready, bool *pressed);
+
+#endif
@@ -0,0 +1,190 @@
+#include <stdint.h>
+#include <avr/io.h>
+#include "matrix.h"
+#include "utility.h"
+#include "link.h"
+#include "log.h"
+
+#define MATRIX_COL_MASK_F 0b11110011
+#define MATRIX_COL_MASK_B 0b11111111
+#if LINK_ENABLE
+#define MATRIX_ROW_MASK_D 0b00010011 /* PD2/PD3 are RXD1/TXD1, see link.h */
+#elif LOG_ENABLE
+#define MATRIX_ROW_MASK_D 0b00010111 /* PD3 is TXD1, see log.h */
+#else
+#define MATRIX_ROW_MASK_D 0b00011111
+#endif
+
+void matrix_init(void) {
+    /*
+    ** Key Matrix Configuration
+    **
+    ** Column (output)
+    ** 1   2   3   4   5   6   7   8   9   10  11  12  13  14
+    ** PF7 PF6 PF5 PF4 PF1 PF0 PB0 PB1 PB2 PB3 PB4 PB5 PB6 PB7
+    **
+    ** Row (input)
+    ** 1   2   3   4   5
+    ** PD0 PD1 PD2 PD3 PD4
+    **
+    ** With LINK_ENABLE rows 3 and 4 are left to USART1: never driven, and
+    ** masked out of every sample so they read as released.
+    */
+
+#if MATRIX_ROW_DRIVEN
+    /*
+    ** Rows are driven low one at a time and idle high, columns are inputs
+    ** with pull-ups. A pressed key pulls its column low through the diode.
+    */
+    DDRF &= ~MATRIX_COL_MASK_F;
+    PORTF |= MATRIX_COL_MASK_F;
+    DDRB = 0b00000000;
+    PORTB = MATRIX_COL_MASK_B;
+    PORTD |= MATRIX_ROW_MASK_D;
+    DDRD |= MATRIX_ROW_MASK_D;
+#else
+    DDRF = MATRIX_COL_MASK_F;
+    DDRB = MATRIX_COL_MASK_B;
+    DDRD = 0b00000000;
+#endif
+}
+
+/*
+** Two cycles for the sensed lines to settle after a strobe is driven, and to
+** recover after it is released. The memory clobber keeps the compiler from
+** moving a sample store into the delay, which a bare _NOP() does not.
+*/
+#define MATRIX_SETTLE() __asm__ __volatile__ ("nop\n\tnop" ::: "memory")
+
+/* Column pin map, index, port letter and bit, in matrix_init() order */
+#define MATRIX_COLUMNS(X) \
+    X(0, F, 7) X(1, F, 6) X(2, F, 5) X(3, F, 4) X(4, F, 1) X(5, F, 0) \
+    X(6, B, 0) X(7, B, 1) X(8, B, 2) X(9, B, 3) X(10, B, 4) X(11, B, 5) X(12, B, 6) X(13, B, 7)
+
+#define MATRIX_COL_PORT(i, port, pin) [i] = &PORT##port,
+#define MATRIX_COL_PIN(i, port, pin) [i] = PORT##port##pin,
+
+volatile uint8_t * const matrix_col_port[COLUMN_COUNT] = { MATRIX_COLUMNS(MATRIX_COL_PORT) };
+const uint8_t matrix_col_pin[COLUMN_COUNT] = { MATRIX_COLUMNS(MATRIX_COL_PIN) };
+
+#if MATRIX_ROW_DRIVEN
+
+void matrix_scan(uint8_t buffer[COLUMN_COUNT]) {
+    uint8_t sample_f[ROW_COUNT];
+    uint8_t sample_b[ROW_COUNT];
+    uint8_t any = 0x00;
+
+    for (uint8_t j = 0; j < ROW_COUNT; ++j) {
+        if (!(MATRIX_ROW_MASK_D & _BV(j))) {
+            sample_f[j] = 0x00;
+            sample_b[j] = 0x00;
+            continue;
+        }
+        PORTD &= ~_BV(j);
+        MATRIX_SETTLE();
+        sample_f[j] = ~PINF & MATRIX_COL_MASK_F;
+        sample_b[j] = ~PINB & MATRIX_COL_MASK_B;
+        PORTD |= _BV(j);
+        MATRIX_SETTLE();
+        any |= sample_f[j] | sample_b[j];
+    }
+
+    for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+        buffer[i] = 0x00;
+    }
+    if (any == 0x00) {
+        return;
+    }
+
+    /* Transpose row samples into per-column row bits */
+    for (uint8_t j = 0; j < ROW_COUNT; ++j) {
+        if ((sample_f[j] | sample_b[j]) == 0x00) {
+            continue;
+        }
+        for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+            uint8_t sample = matrix_col_port[i] == &PORTF ? sample_f[j] : sample_b[j];
+            if (sample & _BV(matrix_col_pin[i])) {
+                buffer[i] |= _BV(j);
+            }
+        }
+    }
+}
+
+#else
+
+/*
+** Consecutive columns for the pipelined scan: index, port and bit of the
+** column whose sample is stored, then port and bit of the one driven next.
+** Follows MATRIX_COLUMNS.
+*/
+#define MATRIX_COLUMN_PAIRS(X) \
+    X(0, F, 7, F, 6) X(1, F, 6, F, 5) X(2, F, 5, F, 4) X(3, F, 4, F, 1) X(4, F, 1, F, 0) \
+    X(5, F, 0, B, 0) X(6, B, 0, B, 1) X(7, B, 1, B, 2) X(8, B, 2, B, 3) X(9, B, 3, B, 4) \
+    X(10, B, 4, B, 5) X(11, B, 5, B, 6) X(12, B, 6, B, 7)
+
+/*
+** Pipelined strobes, unrolled with constant ports so every drive is a single
+** sbi/cbi that leaves the rest of the port alone. Column i is released and
+** column i + 1 driven before column i's sample is stored, so the store runs
+** inside the next settle window instead of after it:
+**
+**   cbi col i, sbi col i+1, andi/st row[i], nop, nop, in PIND
+**
+** 10 cycles a strobe by instruction count, against 12 for the unpipelined
+** sbi, nop, nop, in, andi/st, cbi, nop, nop and about 30 for the loop over
+** matrix_col_port[] it replaced. The rows still get 6 cycles from a release
+** to the next sample to discharge, as before, and a driven column now gets 4
+** instead of 2 to settle. The barrier keeps the store after the drives.
+*/
+#define MATRIX_STROBE(i, port, pin, next_port, next_pin) \
+    PORT##port &= ~_BV(PORT##port##pin); \
+    PORT##next_port |= _BV(PORT##next_port##next_pin); \
+    COMPILER_BARRIER; \
+    buffer[i] = sample & MATRIX_ROW_MASK_D; \
+    MATRIX_SETTLE(); \
+    sample = PIND;
+
+void matrix_scan(uint8_t buffer[COLUMN_COUNT]) {
+    PORTF |= _BV(PORTF7); /* column 0 */
+    MATRIX_SETTLE();
+    uint8_t sample = PIND;
+    MATRIX_COLUMN_PAIRS(MATRIX_STROBE)
+    PORTB &= ~_BV(PORTB7); /* column 13 */
+    COMPILER_BARRIER;
+    buffer[COLUMN_COUNT - 1] = sample & MATRIX_ROW_MASK_D;
+    MATRIX_SETTLE();
+}
+
+#endif
+
+#if MATRIX_ROW_DRIVEN
+
+void matrix_idle_enter(void) {
+    PORTD &= ~MATRIX_ROW_MASK_D;
+}
+
+bool matrix_idle_poll(void) {
+    return (~PINF & MATRIX_COL_MASK_F) | (~PINB & MATRIX_COL_MASK_B);
+}
+
+void matrix_idle_exit(void) {
+    PORTD |= MATRIX_ROW_MASK_D;
+}
+
+#else
+
+void matrix_idle_enter(void) {
+    PORTF |= MATRIX_COL_MASK_F;
+    PORTB = MATRIX_COL_MASK_B;
+}
+
+bool matrix_idle_poll(void) {
+    return PIND & MATRIX_ROW_MASK_D;
+}
+
+void matrix_idle_exit(void) {
+    PORTF &= ~MATRIX_COL_MASK_F;
+    PORTB = 0b00000000;
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include <stdint.h>
+
+#define COLUMN_COUNT 14
+#define ROW_COUNT 5
+
+/*
+** 0: drive the 14 columns high one at a time and read the rows on PIND.
+** 1: drive the 5 rows low one at a time and read all columns from PINF and
+**    PINB through the internal pull-ups, 5 strobes instead of 14.
+*/
+#ifndef MATRIX_ROW_DRIVEN
+#define MATRIX_ROW_DRIVEN 0
+#endif
+
+void matrix_init(void);
+void matrix_scan(uint8_t buffer[COLUMN_COUNT]);
+
+/*
+** Idle mode: every strobe line is driven at once so that a single read sees
+** any key. It is polled once per tick rather than armed as a wake interrupt,
+** PD4 and the PORTF columns have none and would need the poll regardless.
+*/
+void matrix_idle_enter(void);
+bool matrix_idle_poll(void);
+void matrix_idle_exit(void);
+
+#endif
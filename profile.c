@@ -0,0 +1,101 @@
+#include <stdint.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+#include "profile.h"
+#include "report.h"
+
+#ifndef NDEBUG
+
+typedef struct {
+    uint16_t min;
+    uint16_t max;
+    uint32_t sum;
+    uint16_t count;
+    uint8_t histogram[PROFILE_BUCKETS];
+} profile_section_t;
+
+static profile_section_t profile_sections[PROFILE_COUNT];
+volatile uint16_t profile_sof_blocked = 0; /* SOFs held back by USB_COM_vect */
+
+void profile_init(void) {
+    /* Timer1 normal mode, clk/1, wraps every 4 ms at 16 MHz */
+    TCCR1A = 0x00;
+    TCCR1B = _BV(CS10);
+    for (uint8_t i = 0; i < PROFILE_COUNT; ++i) {
+        profile_sections[i].min = 0xFFFF;
+    }
+}
+
+/* TCNT1 goes through the shared TEMP register, keep interrupts out of the read */
+uint16_t profile_now(void) {
+    uint16_t now;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        now = TCNT1;
+    }
+    return now;
+}
+
+void profile_record(uint8_t section, uint16_t cycles) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        profile_section_t *s = &profile_sections[section];
+        if (cycles < s->min) {
+            s->min = cycles;
+        }
+        if (cycles > s->max) {
+            s->max = cycles;
+        }
+        if (s->count == 0xFFFF) {
+            s->sum >>= 1;
+            s->count >>= 1;
+        }
+        s->sum += cycles;
+        ++s->count;
+
+        uint8_t bucket = 0;
+        for (uint16_t bound = 64; bucket < PROFILE_BUCKETS - 1 && cycles >= bound; bound <<= 1) {
+            ++bucket;
+        }
+        if (s->histogram[bucket] == 0xFF) {
+            /* Halve every bucket to keep the shape of the distribution */
+            for (uint8_t i = 0; i < PROFILE_BUCKETS; ++i) {
+                s->histogram[i] >>= 1;
+            }
+        }
+        ++s->histogram[bucket];
+    }
+}
+
+/*
+** Feature report: per section min, max, mean (little endian) and histogram.
+** Also called from raw_task(), so each section is copied with interrupts off
+** and the division runs on the copy.
+*/
+uint8_t profile_report(uint8_t data[PROFILE_REPORT_SIZE]) {
+    uint8_t n = 0;
+    data[n++] = REPORT_ID_PROFILE;
+    for (uint8_t i = 0; i < PROFILE_COUNT; ++i) {
+        profile_section_t s;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            s = profile_sections[i];
+        }
+        uint16_t mean = s.count ? s.sum / s.count : 0;
+        data[n++] = s.min;
+        data[n++] = s.min >> 8;
+        data[n++] = s.max;
+        data[n++] = s.max >> 8;
+        data[n++] = mean;
+        data[n++] = mean >> 8;
+        for (uint8_t k = 0; k < PROFILE_BUCKETS; ++k) {
+            data[n++] = s.histogram[k];
+        }
+    }
+    uint16_t blocked;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        blocked = profile_sof_blocked;
+    }
+    data[n++] = blocked;
+    data[n++] = blocked >> 8;
+    return n;
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+/*
+** Cycle counts of the hot paths, measured with Timer1 running at F_CPU.
+** Compiled out under NDEBUG, read by the host as feature report
+** REPORT_ID_PROFILE.
+*/
+
+enum {
+    PROFILE_SCAN,
+    PROFILE_REPORT,
+    PROFILE_USB_GEN,
+    PROFILE_USB_COM,
+    PROFILE_COUNT,
+};
+
+#define PROFILE_BUCKETS 8 /* below 64, 128, ..., 4096 cycles and above */
+#define PROFILE_SECTION_SIZE (3 * 2 + PROFILE_BUCKETS)
+#define PROFILE_REPORT_SIZE (1 + PROFILE_COUNT * PROFILE_SECTION_SIZE + 2)
+static_assert(PROFILE_REPORT_SIZE <= 64);
+
+#ifndef NDEBUG
+
+extern volatile uint16_t profile_sof_blocked;
+
+void profile_init(void);
+uint16_t profile_now(void);
+void profile_record(uint8_t section, uint16_t cycles);
+uint8_t profile_report(uint8_t data[PROFILE_REPORT_SIZE]);
+
+#define PROFILE_BEGIN(section) uint16_t profile_start_##section = profile_now()
+#define PROFILE_END(section) profile_record(section, profile_now() - profile_start_##section)
+
+#else
+
+#define profile_init() ((void)0)
+#define PROFILE_BEGIN(section) ((void)0)
+#define PROFILE_END(section) ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,114 @@
+#include <stdint.h>
+#include <util/atomic.h>
+#include "raw.h"
+#include "usb.h"
+#include "report.h"
+#include "scheduler.h"
+#include "profile.h"
+#include "idle.h"
+#include "trace.h"
+#include "taphold.h"
+#include "log.h"
+#include "link.h"
+#include "utility.h"
+
+uint8_t raw_rx[RAW_REPORT_SIZE] = { 0, };
+uint8_t raw_tx[RAW_REPORT_SIZE] = { 0, };
+volatile bool raw_rx_full = false;
+volatile bool raw_tx_full = false;
+
+#ifndef NDEBUG
+static_assert(1 + PROFILE_REPORT_SIZE <= RAW_REPORT_SIZE);
+#endif
+
+static uint8_t raw_put16(uint8_t *data, uint16_t value) {
+    data[0] = value & 0xFF;
+    data[1] = value >> 8;
+    return 2;
+}
+
+/* Counters of a feature that is built out read as zero, the offsets never move */
+static void raw_stats(uint8_t *data) {
+    uint16_t staleness;
+    uint16_t staleness_max;
+    uint16_t resume;
+    uint16_t resume_max;
+    uint16_t dropped = 0;
+    uint16_t frames = 0;
+    uint16_t errors = 0;
+    uint16_t gaps = 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        staleness = usb_report_staleness_us;
+        staleness_max = usb_report_staleness_max_us;
+        resume = usb_resume_us;
+        resume_max = usb_resume_max_us;
+#if LOG_ENABLE
+        dropped = log_dropped;
+#endif
+#if LINK_ENABLE
+        frames = link_frames;
+        errors = link_errors;
+        gaps = link_gaps;
+#endif
+    }
+    data += raw_put16(data, scheduler_missed);
+    *data++ = report_queue_peak;
+    data += raw_put16(data, report_queue_drops);
+    data += raw_put16(data, staleness);
+    data += raw_put16(data, staleness_max);
+    data += raw_put16(data, idle_wakes);
+    data += raw_put16(data, idle_wake_us);
+    data += raw_put16(data, idle_wake_max_us);
+    data += raw_put16(data, resume);
+    data += raw_put16(data, resume_max);
+    data += raw_put16(data, taphold_overflows);
+    data += raw_put16(data, dropped);
+    data += raw_put16(data, frames);
+    data += raw_put16(data, errors);
+    data += raw_put16(data, gaps);
+}
+
+#if TRACE_DEPTH
+/* Event count, events lost so far, then the oldest events */
+static void raw_trace(uint8_t *data) {
+    uint16_t lost;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        lost = trace_lost;
+    }
+    raw_put16(data + 1, lost);
+    data[0] = trace_drain(data + 3, (RAW_REPORT_SIZE - 4) / TRACE_EVENT_SIZE);
+}
+#endif
+
+/* Answer the pending host packet, runs from the main loop */
+void raw_task(void) {
+    if (!raw_rx_full || raw_tx_full) {
+        return;
+    }
+    for (uint8_t i = 0; i < RAW_REPORT_SIZE; ++i) {
+        raw_tx[i] = 0x00;
+    }
+    raw_tx[0] = raw_rx[0];
+    switch (raw_rx[0]) {
+        case RAW_COMMAND_STATS:
+            raw_stats(raw_tx + 1);
+            break;
+#ifndef NDEBUG
+        case RAW_COMMAND_PROFILE:
+            profile_report(raw_tx + 1);
+            break;
+#endif
+#if TRACE_DEPTH
+        case RAW_COMMAND_TRACE:
+            raw_trace(raw_tx + 1);
+            break;
+#endif
+        default:
+            raw_tx[0] = RAW_COMMAND_UNKNOWN;
+            break;
+    }
+    COMPILER_BARRIER;
+    raw_rx_full = false;
+    raw_tx_full = true;
+    usb_raw_ready();
+}
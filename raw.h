@@ -0,0 +1,28 @@
+#ifndef RAW_H
+#define RAW_H
+
+#include <stdint.h>
+
+/* Fixed packet size of the vendor interface, both directions */
+#define RAW_REPORT_SIZE 64
+
+/* First byte of a host packet, echoed back as the first byte of the reply */
+#define RAW_COMMAND_STATS 0x01
+#define RAW_COMMAND_PROFILE 0x02
+#define RAW_COMMAND_TRACE 0x03
+#define RAW_COMMAND_UNKNOWN 0xFF
+
+/*
+** One packet deep in each direction. raw_rx is filled by the endpoint
+** interrupt and released by raw_task(), raw_tx the other way around. While a full flag
+** is set the owning side leaves the buffer alone, and the OUT endpoint keeps
+** NAKing the host until the pending command is answered.
+*/
+extern uint8_t raw_rx[RAW_REPORT_SIZE];
+extern uint8_t raw_tx[RAW_REPORT_SIZE];
+extern volatile bool raw_rx_full;
+extern volatile bool raw_tx_full;
+
+void raw_task(void);
+
+#endif /* RAW_H */
@@ -0,0 +1,205 @@
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "matrix.h"
+#include "keymap.h"
+#include "report.h"
+#include "macro.h"
+#include "taphold.h"
+#include "usb_hid_keys.h"
+
+report_slot_t report_queue[REPORT_QUEUE_DEPTH] = {
+    [REPORT_QUEUE_DEPTH - 1] = { .data = { REPORT_ID_KEYBOARD }, .length = REPORT_INPUT_SIZE },
+};
+volatile uint8_t report_queue_head = 0;
+volatile uint8_t report_queue_tail = 0;
+volatile uint8_t report_queue_peak = 0;
+volatile uint16_t report_queue_drops = 0;
+volatile uint8_t report_protocol = REPORT_PROTOCOL_REPORT;
+
+/*
+** Report byte and bit of every keycode, computed at compile time so the
+** builder does no division or shifting. Modifiers (0xE0-0xE7) live in byte 0,
+** usages 0x01-0xA4 in the bitmap after it, everything else maps to nothing.
+*/
+typedef struct {
+    uint8_t offset;
+    uint8_t mask;
+} report_bit_t;
+
+#define REPORT_IS_MOD(code) ((code) >= 0xE0 && (code) <= 0xE7)
+#define REPORT_IS_USAGE(code) ((code) >= 0x01 && (code) <= 0xA4)
+#define REPORT_BIT(code) { \
+    .offset = REPORT_IS_USAGE(code) ? 1 + (code) / 8 : 0, \
+    .mask = REPORT_IS_MOD(code) ? 1 << ((code) & 0x07) : REPORT_IS_USAGE(code) ? 1 << ((code) % 8) : 0, \
+}
+#define REPORT_BITS_4(n) REPORT_BIT(n), REPORT_BIT((n) + 1), REPORT_BIT((n) + 2), REPORT_BIT((n) + 3)
+#define REPORT_BITS_16(n) REPORT_BITS_4(n), REPORT_BITS_4((n) + 4), REPORT_BITS_4((n) + 8), REPORT_BITS_4((n) + 12)
+#define REPORT_BITS_64(n) REPORT_BITS_16(n), REPORT_BITS_16((n) + 16), REPORT_BITS_16((n) + 32), REPORT_BITS_16((n) + 48)
+
+static const report_bit_t report_bits[256] PROGMEM = {
+    REPORT_BITS_64(0x00), REPORT_BITS_64(0x40), REPORT_BITS_64(0x80), REPORT_BITS_64(0xC0),
+};
+
+static uint8_t report_previous[COLUMN_COUNT] = { 0, };
+static uint8_t report_state[REPORT_SIZE] = { 0, };
+static bool report_dirty = false;
+static uint8_t report_format = REPORT_PROTOCOL_REPORT;
+
+static void report_set(uint8_t keycode, bool pressed) {
+    const report_bit_t *bit = &report_bits[keycode];
+    uint8_t offset = pgm_read_byte(&bit->offset);
+    uint8_t mask = pgm_read_byte(&bit->mask);
+    if (pressed) {
+        report_state[offset] |= mask;
+    } else {
+        report_state[offset] &= ~mask;
+    }
+}
+
+/* 6KRO boot report from the bitmap, ErrorRollOver in every slot past six keys */
+static uint8_t report_boot(const uint8_t state[REPORT_SIZE], uint8_t data[]) {
+    data[0] = state[0];
+    data[1] = 0x00;
+    uint8_t n = 2;
+    for (uint8_t i = 1; i < REPORT_SIZE; ++i) {
+        uint8_t bits = state[i];
+        for (uint8_t keycode = (i - 1) * 8; bits; ++keycode, bits >>= 1) {
+            if (!(bits & 0x01)) {
+                continue;
+            }
+            if (n == REPORT_BOOT_SIZE) {
+                for (n = 2; n < REPORT_BOOT_SIZE; ++n) {
+                    data[n] = KEY_ERR_OVF;
+                }
+                return REPORT_BOOT_SIZE;
+            }
+            data[n++] = keycode;
+        }
+    }
+    while (n < REPORT_BOOT_SIZE) {
+        data[n++] = KEY_NONE;
+    }
+    return REPORT_BOOT_SIZE;
+}
+
+/* Apply only the keys that changed since the previous scan */
+void report_update(const uint8_t buffer[COLUMN_COUNT], uint32_t sampled) {
+    taphold_tick();
+
+    bool pressed;
+    uint8_t step = macro_next(report_queue_length() < MACRO_QUEUE_TARGET, &pressed);
+    if (step != KEY_NONE) {
+        report_set(step, pressed);
+        report_dirty = true;
+    }
+
+    for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+        uint8_t delta = buffer[i] ^ report_previous[i];
+        if (delta == 0x00) {
+            continue;
+        }
+        report_previous[i] = buffer[i];
+        for (uint8_t j = 0; delta; ++j, delta >>= 1) {
+            if (delta & 0x01) {
+                if (buffer[i] & _BV(j)) {
+                    uint8_t keycode = keymap_press(i, j);
+                    if (IS_MACRO(keycode)) {
+                        macro_play(keycode - MACRO(0));
+                    } else {
+                        taphold_event(keycode, true);
+                    }
+                } else {
+                    taphold_event(keymap_release(i, j), false);
+                }
+            }
+        }
+    }
+
+    uint8_t keycode;
+    while (taphold_next(&keycode, &pressed)) {
+        report_set(keycode, pressed);
+        report_dirty = true;
+    }
+
+    bool reformat = report_format != report_protocol;
+    if (!report_dirty && !reformat) {
+        return;
+    }
+    report_format = report_protocol;
+
+    uint8_t data[REPORT_INPUT_SIZE];
+    uint8_t size;
+    if (report_format == REPORT_PROTOCOL_BOOT) {
+        size = report_boot(report_state, data);
+    } else {
+        data[0] = REPORT_ID_KEYBOARD;
+        for (uint8_t i = 0; i < REPORT_SIZE; ++i) {
+            data[1 + i] = report_state[i];
+        }
+        size = REPORT_INPUT_SIZE;
+    }
+
+    uint8_t head = report_queue_head;
+    const report_slot_t *last = &report_queue[(uint8_t)(head - 1) & (REPORT_QUEUE_DEPTH - 1)];
+    bool changed = reformat || size != last->length;
+    for (uint8_t i = 0; !changed && i < size; ++i) {
+        changed = data[i] != last->data[i];
+    }
+    if (!changed) {
+        report_dirty = false;
+        return;
+    }
+
+    uint8_t length = (uint8_t)(head - report_queue_tail);
+    if (length == REPORT_QUEUE_DEPTH) {
+        /* Keep the change and retry on the next scan */
+        report_dirty = true;
+        ++report_queue_drops;
+        return;
+    }
+
+    report_slot_t *slot = &report_queue[head & (REPORT_QUEUE_DEPTH - 1)];
+    for (uint8_t i = 0; i < size; ++i) {
+        slot->data[i] = data[i];
+    }
+    slot->length = size;
+    slot->stamp = sampled;
+    COMPILER_BARRIER;
+    report_queue_head = head + 1;
+    report_dirty = false;
+
+    if (length + 1 > report_queue_peak) {
+        report_queue_peak = length + 1;
+    }
+}
+
+/*
+** A slot in the protocol now in effect, for the USB side to send while the
+** scan loop has not caught up with a SET_PROTOCOL yet, e.g. while it is
+** parked. A boot report that rolled over converts to the modifiers alone.
+*/
+uint8_t report_convert(const report_slot_t *slot, uint8_t data[REPORT_INPUT_SIZE]) {
+    if (report_slot_current(slot)) {
+        for (uint8_t i = 0; i < slot->length; ++i) {
+            data[i] = slot->data[i];
+        }
+        return slot->length;
+    }
+    if (report_protocol == REPORT_PROTOCOL_BOOT) {
+        return report_boot(slot->data + 1, data);
+    }
+    data[0] = REPORT_ID_KEYBOARD;
+    data[1] = slot->data[0];
+    for (uint8_t i = 2; i < REPORT_INPUT_SIZE; ++i) {
+        data[i] = 0x00;
+    }
+    for (uint8_t n = 2; n < REPORT_BOOT_SIZE; ++n) {
+        uint8_t keycode = slot->data[n];
+        if (keycode > KEY_ERR_OVF) {
+            const report_bit_t *bit = &report_bits[keycode];
+            data[1 + pgm_read_byte(&bit->offset)] |= pgm_read_byte(&bit->mask);
+        }
+    }
+    return REPORT_INPUT_SIZE;
+}
@@ -0,0 +1,75 @@
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stdint.h>
+#include "matrix.h"
+#include "utility.h"
+
+static_assert((165 + 3) % 8 == 0);
+#define REPORT_SIZE (1 + ((165 + 3) / 8))
+#define REPORT_INPUT_SIZE (1 + REPORT_SIZE) /* report ID and NKRO bitmap */
+#define REPORT_BOOT_SIZE 8
+
+#define REPORT_ID_KEYBOARD 1
+#define REPORT_ID_PROFILE 2
+
+/* bInterfaceProtocol values of SET_PROTOCOL */
+#define REPORT_PROTOCOL_BOOT 0
+#define REPORT_PROTOCOL_REPORT 1
+
+/* Reports waiting for the host, power of two */
+#ifndef REPORT_QUEUE_DEPTH
+#define REPORT_QUEUE_DEPTH 8
+#endif
+static_assert(REPORT_QUEUE_DEPTH >= 2 && REPORT_QUEUE_DEPTH <= 128);
+static_assert((REPORT_QUEUE_DEPTH & (REPORT_QUEUE_DEPTH - 1)) == 0);
+
+typedef struct {
+    uint8_t data[REPORT_INPUT_SIZE];
+    uint8_t length; /* REPORT_INPUT_SIZE, or REPORT_BOOT_SIZE in boot protocol */
+    uint32_t stamp; /* when the matrix behind the report was sampled */
+} report_slot_t;
+
+/*
+** Single-producer/single-consumer ring between the scan loop and the SOF
+** interrupt. Indices run freely and are masked on access, head is only
+** written by report_update(), tail only by the consumer.
+*/
+extern report_slot_t report_queue[REPORT_QUEUE_DEPTH];
+extern volatile uint8_t report_queue_head;
+extern volatile uint8_t report_queue_tail;
+extern volatile uint8_t report_queue_peak;
+extern volatile uint16_t report_queue_drops;
+extern volatile uint8_t report_protocol;
+
+static inline uint8_t report_queue_length(void) {
+    return (uint8_t)(report_queue_head - report_queue_tail);
+}
+
+static inline const report_slot_t *report_queue_front(void) {
+    const report_slot_t *slot = &report_queue[report_queue_tail & (REPORT_QUEUE_DEPTH - 1)];
+    COMPILER_BARRIER;
+    return slot;
+}
+
+/* Most recently queued report, the current state as far as the host is concerned */
+static inline const report_slot_t *report_queue_back(void) {
+    const report_slot_t *slot = &report_queue[(uint8_t)(report_queue_head - 1) & (REPORT_QUEUE_DEPTH - 1)];
+    COMPILER_BARRIER;
+    return slot;
+}
+
+static inline void report_queue_pop(void) {
+    COMPILER_BARRIER;
+    report_queue_tail = report_queue_tail + 1;
+}
+
+/* Whether a slot is in the protocol now in effect, it is not when queued before a SET_PROTOCOL */
+static inline bool report_slot_current(const report_slot_t *slot) {
+    return (slot->length == REPORT_BOOT_SIZE) == (report_protocol == REPORT_PROTOCOL_BOOT);
+}
+
+void report_update(const uint8_t buffer[COLUMN_COUNT], uint32_t sampled);
+uint8_t report_convert(const report_slot_t *slot, uint8_t data[REPORT_INPUT_SIZE]);
+
+#endif
@@ -0,0 +1,100 @@
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#include "scheduler.h"
+
+static volatile uint8_t scheduler_ticks = 0;
+static volatile uint32_t scheduler_epoch = 0;
+volatile uint16_t scheduler_missed = 0;
+
+ISR(TIMER3_COMPA_vect, ISR_BLOCK) {
+    scheduler_epoch += SCHEDULER_TOP + 1;
+    if (scheduler_ticks != 0xFF) {
+        ++scheduler_ticks;
+    }
+}
+
+void scheduler_init(void) {
+    /* Timer3 CTC mode (TOP = OCR3A), clk/8 */
+    TCCR3A = 0x00;
+    TCCR3B = _BV(WGM32) | _BV(CS31);
+    OCR3A = SCHEDULER_TOP;
+    TCNT3 = 0;
+    TIMSK3 = _BV(OCIE3A);
+    set_sleep_mode(SLEEP_MODE_IDLE);
+}
+
+/*
+** Phase-lock the tick to Start of Frame so that the last scan of every frame
+** starts SCAN_LEAD_US before the next SOF. Called from USB_GEN_vect.
+*/
+void scheduler_sof(void) {
+    uint16_t count = TCNT3;
+    TCNT3 = SCHEDULER_SOF_PHASE;
+    scheduler_epoch += count;
+    scheduler_epoch -= SCHEDULER_SOF_PHASE;
+}
+
+/* Free-running time in timer counts (SCHEDULER_COUNTS_PER_US per microsecond) */
+uint32_t scheduler_timestamp(void) {
+    uint32_t timestamp;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint16_t count = TCNT3;
+        timestamp = scheduler_epoch + count;
+        if (bit_is_set(TIFR3, OCF3A) && count < SCHEDULER_TOP / 2) {
+            /* compare match not serviced yet */
+            timestamp += SCHEDULER_TOP + 1;
+        }
+    }
+    return timestamp;
+}
+
+/* When the current tick fired, in scheduler_timestamp() counts */
+uint32_t scheduler_tick_timestamp(void) {
+    uint32_t timestamp;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        timestamp = scheduler_epoch;
+    }
+    return timestamp;
+}
+
+/*
+** Sleep until the next tick and return the number of ticks that elapsed since
+** the previous call. Anything above one is a missed scan deadline.
+*/
+uint8_t scheduler_wait(void) {
+    cli();
+    while (scheduler_ticks == 0) {
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+        cli();
+    }
+    uint8_t ticks = scheduler_ticks;
+    scheduler_ticks = 0;
+    sei();
+
+    if (ticks > 1) {
+        scheduler_missed += ticks - 1;
+    }
+    return ticks;
+}
+
+/* Run due jobs in the time left before the next tick */
+void scheduler_run(scheduler_job_t jobs[], uint8_t count) {
+    for (uint8_t i = 0; i < count; ++i) {
+        if (jobs[i].countdown > 1) {
+            --jobs[i].countdown;
+            continue;
+        }
+        if (scheduler_ticks != 0) {
+            /* Out of time, retry on the next tick */
+            continue;
+        }
+        jobs[i].run();
+        jobs[i].countdown = jobs[i].period;
+    }
+}
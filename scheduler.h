@@ -0,0 +1,52 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+#ifndef SCAN_RATE_HZ
+#define SCAN_RATE_HZ 1000
+#endif
+
+/* How long before Start of Frame the last scan of a frame starts */
+#ifndef SCAN_LEAD_US
+#define SCAN_LEAD_US 250
+#endif
+
+#define SCHEDULER_PRESCALER 8
+#define SCHEDULER_TOP (F_CPU / SCHEDULER_PRESCALER / SCAN_RATE_HZ - 1)
+/* scan period must be a whole number of timer ticks */
+static_assert(F_CPU / SCHEDULER_PRESCALER % SCAN_RATE_HZ == 0);
+static_assert(SCHEDULER_TOP > 0 && SCHEDULER_TOP <= 0xFFFF);
+/* whole number of scans per USB frame */
+static_assert(SCAN_RATE_HZ % 1000 == 0);
+
+#define SCHEDULER_COUNTS_PER_US (F_CPU / SCHEDULER_PRESCALER / 1000000)
+/*
+** With a tick every SCAN_LEAD_US or less some tick always falls in the lead
+** window, so the lead is clamped to one tick short of the period. Loading
+** TCNT3 with TOP itself would block that compare match.
+*/
+#define SCHEDULER_LEAD_COUNTS (SCAN_LEAD_US * SCHEDULER_COUNTS_PER_US)
+#define SCHEDULER_SOF_PHASE \
+    ((SCHEDULER_LEAD_COUNTS < SCHEDULER_TOP ? SCHEDULER_LEAD_COUNTS : SCHEDULER_TOP) - 1)
+static_assert(SCHEDULER_SOF_PHASE < SCHEDULER_TOP);
+
+/* Milliseconds to scheduler ticks */
+#define SCHEDULER_MS(ms) ((uint16_t)((uint32_t)(ms) * SCAN_RATE_HZ / 1000))
+
+typedef struct {
+    void (*run)(void);
+    uint16_t period; /* in ticks */
+    uint16_t countdown;
+} scheduler_job_t;
+
+extern volatile uint16_t scheduler_missed;
+
+void scheduler_init(void);
+void scheduler_sof(void);
+uint32_t scheduler_timestamp(void);
+uint32_t scheduler_tick_timestamp(void);
+uint8_t scheduler_wait(void);
+void scheduler_run(scheduler_job_t jobs[], uint8_t count);
+
+#endif
@@ -0,0 +1,215 @@
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "taphold.h"
+#include "usb_hid_keys.h"
+
+typedef struct {
+    uint8_t tap;
+    uint8_t hold;
+} taphold_key_t;
+
+static const taphold_key_t taphold_keys[TAPHOLD_COUNT] PROGMEM = {
+    [0] = { .tap = KEY_SPACE, .hold = KEY_LEFTCTRL },
+};
+
+typedef struct {
+    uint8_t keycode;
+    bool pressed;
+} taphold_event_t;
+
+/* Events waiting for the undecided key, in arrival order */
+static taphold_event_t taphold_buffer[TAPHOLD_BUFFER_SIZE];
+static uint8_t taphold_buffered = 0;
+
+/*
+** Decided events on their way to the report, indices run freely. Holds the
+** buffer when it is flushed plus the two events that decide a key.
+*/
+#define TAPHOLD_OUTPUT_SIZE 32
+static_assert(TAPHOLD_OUTPUT_SIZE >= TAPHOLD_BUFFER_SIZE + 2);
+static_assert((TAPHOLD_OUTPUT_SIZE & (TAPHOLD_OUTPUT_SIZE - 1)) == 0);
+static taphold_event_t taphold_output[TAPHOLD_OUTPUT_SIZE];
+static uint8_t taphold_output_head = 0;
+static uint8_t taphold_output_tail = 0;
+
+/* Keycodes changed since the last tick, a second change has to wait a report */
+static uint8_t taphold_touched[TAPHOLD_OUTPUT_SIZE];
+static uint8_t taphold_touched_count = 0;
+
+/*
+** The output ring is drained at most one change per keycode and tick, so it
+** can fill. A release that finds it full is kept as a bit here instead and
+** goes out once the ring is empty, so a key never sticks on the host.
+*/
+uint16_t taphold_overflows = 0;
+static uint8_t taphold_late[256 / 8];
+static uint8_t taphold_late_count = 0;
+
+static uint8_t taphold_pending = KEY_NONE; /* the undecided TAPHOLD(n) */
+static uint16_t taphold_elapsed = 0; /* ticks since it was pressed */
+static uint8_t taphold_holding = 0x00; /* bit n set while entry n is decided as hold */
+
+/*
+** A press of a key whose release is still late cancels it, the key was never
+** reported released and stays down. A press that finds the ring full is lost.
+*/
+static void taphold_emit(uint8_t keycode, bool pressed) {
+    uint8_t *late = &taphold_late[keycode / 8];
+    uint8_t bit = _BV(keycode % 8);
+    if (pressed && (*late & bit)) {
+        *late &= ~bit;
+        --taphold_late_count;
+        return;
+    }
+    if ((uint8_t)(taphold_output_head - taphold_output_tail) == TAPHOLD_OUTPUT_SIZE) {
+        ++taphold_overflows;
+        if (!pressed && !(*late & bit)) {
+            *late |= bit;
+            ++taphold_late_count;
+        }
+        return;
+    }
+    taphold_output[taphold_output_head++ & (TAPHOLD_OUTPUT_SIZE - 1)] = (taphold_event_t){ keycode, pressed };
+}
+
+static void taphold_input(uint8_t keycode, bool pressed);
+
+/* Commit the undecided key and run the events that waited for it */
+static void taphold_decide(bool hold) {
+    uint8_t n = taphold_pending - TAPHOLD(0);
+    uint8_t keycode = pgm_read_byte(hold ? &taphold_keys[n].hold : &taphold_keys[n].tap);
+    taphold_pending = KEY_NONE;
+    if (hold) {
+        taphold_holding |= _BV(n);
+    } else {
+        taphold_holding &= ~_BV(n);
+    }
+    taphold_emit(keycode, true);
+
+    /* Replayed one by one, a TAPHOLD(n) among them becomes undecided in turn */
+    taphold_event_t replay[TAPHOLD_BUFFER_SIZE];
+    uint8_t count = taphold_buffered;
+    for (uint8_t i = 0; i < count; ++i) {
+        replay[i] = taphold_buffer[i];
+    }
+    taphold_buffered = 0;
+    for (uint8_t i = 0; i < count; ++i) {
+        taphold_input(replay[i].keycode, replay[i].pressed);
+    }
+}
+
+static void taphold_input(uint8_t keycode, bool pressed) {
+    if (taphold_pending != KEY_NONE) {
+        if (keycode == taphold_pending && !pressed) {
+            taphold_decide(false);
+            taphold_input(keycode, false);
+            return;
+        }
+        bool tapped = false;
+        for (uint8_t i = 0; !pressed && i < taphold_buffered; ++i) {
+            tapped |= taphold_buffer[i].keycode == keycode && taphold_buffer[i].pressed;
+        }
+        if (taphold_buffered == TAPHOLD_BUFFER_SIZE) {
+            taphold_decide(true);
+            taphold_input(keycode, pressed);
+            return;
+        }
+        taphold_buffer[taphold_buffered++] = (taphold_event_t){ keycode, pressed };
+        if (tapped) {
+            taphold_decide(true);
+        }
+        return;
+    }
+
+    if (!IS_TAPHOLD(keycode)) {
+        taphold_emit(keycode, pressed);
+        return;
+    }
+    uint8_t n = keycode - TAPHOLD(0);
+    if (n >= TAPHOLD_COUNT) {
+        return;
+    }
+    if (pressed) {
+        taphold_pending = keycode;
+        taphold_elapsed = 0;
+        return;
+    }
+    bool hold = taphold_holding & _BV(n);
+    taphold_emit(pgm_read_byte(hold ? &taphold_keys[n].hold : &taphold_keys[n].tap), false);
+    taphold_holding &= ~_BV(n);
+}
+
+/* Key event after keymap resolution, in scan order */
+void taphold_event(uint8_t keycode, bool pressed) {
+    if (keycode == KEY_NONE) {
+        return;
+    }
+    taphold_input(keycode, pressed);
+}
+
+/* Once per scan, before the events of the scan are taken */
+void taphold_tick(void) {
+    taphold_touched_count = 0;
+    if (taphold_pending != KEY_NONE && ++taphold_elapsed >= TAPHOLD_TERM) {
+        taphold_decide(true);
+    }
+}
+
+/* False when keycode already changed since the last tick, otherwise marks it */
+static bool taphold_touch(uint8_t keycode) {
+    if (taphold_touched_count == TAPHOLD_OUTPUT_SIZE) {
+        return false; /* late releases beyond a ring's worth wait a tick */
+    }
+    for (uint8_t i = 0; i < taphold_touched_count; ++i) {
+        if (taphold_touched[i] == keycode) {
+            return false;
+        }
+    }
+    taphold_touched[taphold_touched_count++] = keycode;
+    return true;
+}
+
+/* Lowest late release, once the ring has drained */
+static bool taphold_next_late(uint8_t *keycode) {
+    for (uint8_t i = 0; i < sizeof(taphold_late); ++i) {
+        if (taphold_late[i] == 0x00) {
+            continue;
+        }
+        uint8_t bit = 0;
+        while (!(taphold_late[i] & _BV(bit))) {
+            ++bit;
+        }
+        if (!taphold_touch(i * 8 + bit)) {
+            return false;
+        }
+        taphold_late[i] &= ~_BV(bit);
+        --taphold_late_count;
+        *keycode = i * 8 + bit;
+        return true;
+    }
+    return false;
+}
+
+/*
+** Next decided event for the report. Stops early when the event changes a
+** keycode that already changed since the last tick, so a tap decided in one
+** scan still reaches the host as a press report followed by a release report.
+*/
+bool taphold_next(uint8_t *keycode, bool *pressed) {
+    if (taphold_output_tail == taphold_output_head) {
+        if (taphold_late_count == 0 || !taphold_next_late(keycode)) {
+            return false;
+        }
+        *pressed = false;
+        return true;
+    }
+    const taphold_event_t *event = &taphold_output[taphold_output_tail & (TAPHOLD_OUTPUT_SIZE - 1)];
+    if (!taphold_touch(event->keycode)) {
+        return false;
+    }
+    *keycode = event->keycode;
+    *pressed = event->pressed;
+    ++taphold_output_tail;
+    return true;
+}
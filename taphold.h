@@ -0,0 +1,36 @@
+#ifndef TAPHOLD_H
+#define TAPHOLD_H
+
+#include <stdint.h>
+#include "scheduler.h"
+
+/*
+** Dual-role keys: TAPHOLD(n) sends the tap keycode of entry n when released
+** on its own, and the hold keycode when held. A key is undecided from its
+** press until it is released (tap), another key is pressed and released
+** under it (hold) or TAPHOLD_TERM_MS pass (hold). Events of other keys seen
+** meanwhile are buffered and replayed in order once it is decided.
+*/
+#define TAPHOLD_COUNT 1
+static_assert(TAPHOLD_COUNT >= 1 && TAPHOLD_COUNT <= 8);
+
+#define TAPHOLD(n) (0xB8 + (n))
+#define IS_TAPHOLD(keycode) ((keycode) >= 0xB8 && (keycode) <= 0xBF)
+
+#ifndef TAPHOLD_TERM_MS
+#define TAPHOLD_TERM_MS 200
+#endif
+#define TAPHOLD_TERM SCHEDULER_MS(TAPHOLD_TERM_MS)
+static_assert(TAPHOLD_TERM >= 1);
+
+/* Key events held back while a key is undecided, a full buffer decides hold */
+#define TAPHOLD_BUFFER_SIZE 16
+
+/* Decided events that found the output ring full, see taphold_emit() */
+extern uint16_t taphold_overflows;
+
+void taphold_event(uint8_t keycode, bool pressed);
+void taphold_tick(void);
+bool taphold_next(uint8_t *keycode, bool *pressed);
+
+#endif
@@ -0,0 +1,88 @@
+#include <stdint.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+#include "trace.h"
+#include "matrix.h"
+#include "scheduler.h"
+
+#if TRACE_DEPTH
+
+static trace_event_t trace_ring[TRACE_DEPTH];
+static uint8_t trace_head = 0; /* indices run freely */
+static uint8_t trace_tail = 0;
+volatile uint16_t trace_lost = 0; /* events dropped on a full ring */
+
+static uint16_t trace_frame = 0;
+static uint32_t trace_sof_stamp = 0;
+static uint8_t trace_previous[COLUMN_COUNT] = { 0, };
+
+/* Called from USB_GEN_vect on every SOF */
+void trace_sof(void) {
+    trace_frame = UDFNUM & 0x07FF;
+    trace_sof_stamp = scheduler_timestamp();
+}
+
+/* Producers are the scan loop and USB_COM_vect, so the whole append is atomic */
+static void trace_put(uint8_t kind, uint8_t data) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if ((uint8_t)(trace_head - trace_tail) == TRACE_DEPTH) {
+            ++trace_lost;
+        } else {
+            uint32_t offset = scheduler_timestamp() - trace_sof_stamp;
+            trace_event_t *event = &trace_ring[trace_head & (TRACE_DEPTH - 1)];
+            event->frame = trace_frame;
+            event->offset = offset > 0xFFFF ? 0xFFFF : offset;
+            event->kind = kind;
+            event->data = data;
+            ++trace_head;
+        }
+    }
+}
+
+/* Raw, undebounced transitions, so chatter shows up as it happened */
+void trace_scan(const uint8_t raw[COLUMN_COUNT]) {
+    for (uint8_t i = 0; i < COLUMN_COUNT; ++i) {
+        uint8_t delta = raw[i] ^ trace_previous[i];
+        if (delta == 0x00) {
+            continue;
+        }
+        trace_previous[i] = raw[i];
+        for (uint8_t j = 0; delta; ++j, delta >>= 1) {
+            if (delta & 0x01) {
+                trace_put(raw[i] & _BV(j) ? TRACE_PRESS : TRACE_RELEASE, i << 3 | j);
+            }
+        }
+    }
+}
+
+void trace_report(uint8_t kind, uint8_t sequence) {
+    trace_put(kind, sequence);
+}
+
+/* Move up to capacity events into data, oldest first, returns how many */
+uint8_t trace_drain(uint8_t *data, uint8_t capacity) {
+    uint8_t count = 0;
+    while (count < capacity) {
+        trace_event_t event;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            if (trace_tail != trace_head) {
+                event = trace_ring[trace_tail++ & (TRACE_DEPTH - 1)];
+            } else {
+                event.kind = 0;
+            }
+        }
+        if (event.kind == 0) {
+            break;
+        }
+        *data++ = event.frame & 0xFF;
+        *data++ = event.frame >> 8;
+        *data++ = event.offset & 0xFF;
+        *data++ = event.offset >> 8;
+        *data++ = event.kind;
+        *data++ = event.data;
+        ++count;
+    }
+    return count;
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "matrix.h"
+
+/*
+** Event trace for chatter and latency forensics. Raw matrix transitions,
+** reports entering the queue and reports loaded into EP1 are kept in an SRAM
+** ring, stamped with the USB frame number and the time since that frame's
+** SOF. The host drains it with RAW_COMMAND_TRACE. Compiled out unless
+** TRACE_DEPTH is set.
+*/
+#ifndef TRACE_DEPTH
+#define TRACE_DEPTH 0
+#endif
+static_assert(TRACE_DEPTH == 0 || (TRACE_DEPTH >= 2 && TRACE_DEPTH <= 128));
+static_assert((TRACE_DEPTH & (TRACE_DEPTH - 1)) == 0);
+
+enum {
+    TRACE_PRESS = 1, /* data is column << 3 | row */
+    TRACE_RELEASE = 2,
+    TRACE_QUEUED = 3, /* data is the report's queue sequence number */
+    TRACE_SHIPPED = 4, /* same sequence number, loaded into an EP1 bank */
+};
+
+/* Little-endian on the wire: frame (u16), offset (u16), kind, data */
+typedef struct {
+    uint16_t frame; /* USB frame number of the last SOF, 11 bits */
+    uint16_t offset; /* scheduler counts since that SOF, saturating */
+    uint8_t kind;
+    uint8_t data;
+} trace_event_t;
+#define TRACE_EVENT_SIZE 6
+
+#if TRACE_DEPTH
+
+extern volatile uint16_t trace_lost;
+
+void trace_sof(void);
+void trace_scan(const uint8_t raw[COLUMN_COUNT]);
+void trace_report(uint8_t kind, uint8_t sequence);
+uint8_t trace_drain(uint8_t *data, uint8_t capacity);
+
+#else
+
+#define trace_sof() ((void)0)
+#define trace_scan(raw) ((void)(raw))
+#define trace_report(kind, sequence) ((void)0)
+
+#endif
+
+#endif
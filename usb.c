@@ -1,63 +1,471 @@
 #include <stdint.h>
+#include <stddef.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <util/atomic.h>
 #include "usb.h"
 #include "usb_descriptor.h"
+#include "report.h"
+#include "keymap.h"
+#include "scheduler.h"
+#include "profile.h"
+#include "raw.h"
+#include "trace.h"
+#include "log.h"
 #include "utility.h"
 
 uint8_t usb_configuration_value = 0x00;
-extern volatile uint8_t usb_ep_data_buffer[1 + ((165 + 3) / 8)];
-extern volatile bool usb_ep_data_ready;
+uint8_t usb_idle_rate = 125; /* 4 ms units, 0 for reports on change only */
+static uint16_t usb_idle_elapsed = 0; /* ms since the last report was loaded */
+volatile bool usb_suspended = false;
+volatile bool usb_remote_wakeup_enabled = false;
+volatile uint16_t usb_resume_us = 0;
+volatile uint16_t usb_resume_max_us = 0;
+static uint32_t usb_suspend_stamp = 0;
+static uint32_t usb_resume_stamp = 0;
+static bool usb_resume_pending = false; /* first report after resume not out yet */
+volatile uint16_t usb_report_staleness_us = 0;
+volatile uint16_t usb_report_staleness_max_us = 0;
 
-ISR(USB_GEN_vect, ISR_BLOCK) {
-    if (bit_is_set(UDINT, EORSTI)) {
-        UDINT &= ~_BV(EORSTI);
+static void usb_report_load(const report_slot_t *slot) {
+    uint8_t converted[REPORT_INPUT_SIZE];
+    const uint8_t *data = slot->data;
+    uint8_t length = slot->length;
+    if (!report_slot_current(slot)) {
+        length = report_convert(slot, converted);
+        data = converted;
+    }
+    EP_IN_ACK;
+    for (uint8_t i = 0; i < length; ++i) {
+        UEDATX = data[i];
+    }
+    UEINTX &= ~_BV(FIFOCON);
+    usb_idle_elapsed = 0;
+}
+
+/*
+** EP0 control transfer state. A request is decoded on RXSTPI, then each
+** following TXINI/RXOUTI interrupt moves one packet of the data stage or
+** completes the status stage. Nothing waits on the hardware in between.
+*/
+enum {
+    USB_CONTROL_IDLE,
+    USB_CONTROL_DATA_IN, /* sending packets, host ends with an OUT ZLP */
+    USB_CONTROL_DATA_OUT, /* receiving packets, device ends with an IN ZLP */
+    USB_CONTROL_STATUS_OUT, /* waiting for the host's OUT ZLP */
+    USB_CONTROL_STATUS_IN, /* IN ZLP to be loaded */
+    USB_CONTROL_ADDRESS, /* IN ZLP of SET_ADDRESS to be acknowledged */
+};
+
+static struct {
+    uint8_t state;
+    const uint8_t *data; /* next byte of the data stage */
+    bool flash; /* data points into flash rather than usb_control_buffer */
+    uint16_t remaining; /* bytes left of min(data, wLength) */
+    bool zlp; /* data ran out before wLength, end with a short packet */
+    bool address; /* SET_ADDRESS, enable the address once the status stage is done */
+} usb_control = { .state = USB_CONTROL_IDLE, };
+
+/* RAM data of control reads, and scratch space of control writes */
+static uint8_t usb_control_buffer[64];
+
+static void usb_control_enter(uint8_t state) {
+    usb_control.state = state;
+    switch (state) {
+        case USB_CONTROL_DATA_IN:
+            UEIENX = RXSTPE_SET | RXOUTE_SET | TXINE_SET;
+            break;
+        case USB_CONTROL_DATA_OUT:
+        case USB_CONTROL_STATUS_OUT:
+            UEIENX = RXSTPE_SET | RXOUTE_SET;
+            break;
+        case USB_CONTROL_STATUS_IN:
+        case USB_CONTROL_ADDRESS:
+            UEIENX = RXSTPE_SET | TXINE_SET;
+            break;
+        case USB_CONTROL_IDLE:
+        default:
+            UEIENX = RXSTPE_SET;
+            break;
+    }
+}
+
+/*
+** Start a control read. The data stage is clamped to wLength, and ends with a
+** short packet or ZLP when the data runs out first.
+*/
+static void usb_control_read(const uint8_t *data, bool flash, uint16_t length, uint16_t requested) {
+    usb_control.data = data;
+    usb_control.flash = flash;
+    usb_control.remaining = length < requested ? length : requested;
+    usb_control.zlp = length < requested;
+    usb_control_enter(USB_CONTROL_DATA_IN);
+}
+
+/* Control read of usb_control_buffer */
+static void usb_control_in(uint16_t length, uint16_t requested) {
+    usb_control_read(usb_control_buffer, false, length, requested);
+}
+
+/* Control read of a slice of usb_descriptors */
+static void usb_control_in_P(const void *data, uint16_t length, uint16_t requested) {
+    usb_control_read(data, true, length, requested);
+}
+
+/* Receive and drop a control write data stage, then acknowledge it */
+static void usb_control_out(uint16_t requested) {
+    usb_control.remaining = requested;
+    usb_control_enter(requested ? USB_CONTROL_DATA_OUT : USB_CONTROL_STATUS_IN);
+}
+
+/* Acknowledge a request without data stage */
+static void usb_control_status(void) {
+    usb_control_enter(USB_CONTROL_STATUS_IN);
+}
+
+/* Load the next packet of a control read */
+static void usb_control_in_packet(void) {
+    uint8_t count = usb_control.remaining < 64 ? usb_control.remaining : 64;
+    if (usb_control.flash) {
+        for (uint8_t i = 0; i < count; ++i) {
+            UEDATX = pgm_read_byte(usb_control.data++);
+        }
+    } else {
+        for (uint8_t i = 0; i < count; ++i) {
+            UEDATX = *usb_control.data++;
+        }
+    }
+    usb_control.remaining -= count;
+    EP_IN_ACK;
+    if (count < 64 || (usb_control.remaining == 0 && !usb_control.zlp)) {
+        usb_control_enter(USB_CONTROL_STATUS_OUT);
+    }
+}
+
+static void usb_control_service(void) {
+    switch (usb_control.state) {
+        case USB_CONTROL_DATA_IN:
+            if (bit_is_set(UEINTX, RXOUTI)) {
+                /* Host took less than it asked for and moved on to the status stage */
+                EP_OUT_ACK;
+                usb_control_enter(USB_CONTROL_IDLE);
+            } else if (bit_is_set(UEINTX, TXINI)) {
+                usb_control_in_packet();
+            }
+            break;
+        case USB_CONTROL_DATA_OUT:
+            if (bit_is_set(UEINTX, RXOUTI)) {
+                uint8_t count = UEBCLX;
+                for (uint8_t i = 0; i < count; ++i) {
+                    usb_control_buffer[i & 63] = UEDATX;
+                }
+                EP_OUT_ACK;
+                usb_control.remaining -= count < usb_control.remaining ? count : usb_control.remaining;
+                if (usb_control.remaining == 0 || count < 64) {
+                    usb_control_enter(USB_CONTROL_STATUS_IN);
+                }
+            }
+            break;
+        case USB_CONTROL_STATUS_OUT:
+            if (bit_is_set(UEINTX, RXOUTI)) {
+                EP_OUT_ACK;
+                usb_control_enter(USB_CONTROL_IDLE);
+            }
+            break;
+        case USB_CONTROL_STATUS_IN:
+            if (bit_is_set(UEINTX, TXINI)) {
+                EP_IN_ACK;
+                usb_control_enter(usb_control.address ? USB_CONTROL_ADDRESS : USB_CONTROL_IDLE);
+            }
+            break;
+        case USB_CONTROL_ADDRESS:
+            if (bit_is_set(UEINTX, TXINI)) {
+                /* Status stage done, the new address applies from here on */
+                UDADDR |= ADDEN_SET;
+                usb_control.address = false;
+                usb_control_enter(USB_CONTROL_IDLE);
+            }
+            break;
+    }
+}
+
+/*
+** Resume runs in two halves so nothing waits on the PLL lock (around 100 us)
+** with interrupts off: the PLL is started where the resume is detected or
+** requested, and usb_task() unfreezes the clock once PLOCK is up. The resume
+** stats are stamped at the start, so they include the lock time.
+*/
+static volatile bool usb_clock_starting = false;
+static bool usb_remote_pending = false; /* RMWKUP once the clock runs */
 
-        UENUM = 0;
-        EP_ENABLE;
-        UECFG0X = EPTYPE_CONTROL;
-        UECFG1X = EPSIZE_64BYTE | EPBK_ONEBANK | ALLOC_SET;
-        if (bit_is_clear(UESTA0X, CFGOK)) {
+static void usb_clock_start(void) {
+    PLLCSR |= _BV(PLLE);
+    UDIEN &= ~WAKEUPE_SET; /* WAKEUPI only clears with the clock running */
+    usb_clock_starting = true;
+    usb_resume_stamp = scheduler_timestamp();
+}
+
+/* Finish a resume once the PLL has locked, called from the main loop */
+void usb_task(void) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (!usb_clock_starting || bit_is_clear(PLLCSR, PLOCK)) {
             return;
         }
-        EP0_FIFO_RESET;
-        EP_FIFO_RESET_COMPLETE;
-        UEIENX = RXSTPE_SET;
-
-        UENUM = 1;
-        EP_ENABLE;
-        UECONX = EPEN_SET;
-        UECFG0X = EPTYPE_INTERRUPT | EPDIR_IN;
-        UECFG1X = EPSIZE_32BYTE | EPBK_ONEBANK | ALLOC_SET;
-        if (bit_is_clear(UESTA0X, CFGOK)) {
+        USBCON &= ~_BV(FRZCLK);
+        usb_clock_starting = false;
+        if (usb_remote_pending) {
+            UDCON |= _BV(RMWKUP);
+            usb_remote_pending = false;
+        }
+        UDINT &= ~_BV(WAKEUPI);
+        UDIEN = (UDIEN & ~WAKEUPE_SET) | SUSPE_SET;
+        usb_suspended = false;
+        usb_resume_pending = true;
+    }
+}
+
+/*
+** Signal resume upstream, called from the main loop when a key changes while
+** the bus is suspended. Spec requires the bus to have been idle for 5 ms,
+** SUSPI comes after 3 ms, so hold off for the rest.
+*/
+void usb_remote_wakeup(void) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (!usb_suspended || !usb_remote_wakeup_enabled || usb_clock_starting) {
+            return;
+        }
+        if (scheduler_timestamp() - usb_suspend_stamp < 2000UL * SCHEDULER_COUNTS_PER_US) {
+            return;
+        }
+        usb_remote_pending = true;
+        usb_clock_start();
+    }
+}
+
+static void usb_report_shipped(uint32_t stamp) {
+    if (usb_resume_pending) {
+        uint32_t resume = (scheduler_timestamp() - usb_resume_stamp) / SCHEDULER_COUNTS_PER_US;
+        usb_resume_us = resume > 0xFFFF ? 0xFFFF : resume;
+        if (usb_resume_us > usb_resume_max_us) {
+            usb_resume_max_us = usb_resume_us;
+        }
+        usb_resume_pending = false;
+    }
+    uint32_t age = (scheduler_timestamp() - stamp) / SCHEDULER_COUNTS_PER_US;
+    usb_report_staleness_us = age > 0xFFFF ? 0xFFFF : age;
+    if (usb_report_staleness_us > usb_report_staleness_max_us) {
+        usb_report_staleness_max_us = usb_report_staleness_us;
+    }
+}
+
+/* Fill every free EP1 bank, back to back reports go out on consecutive polls */
+static void usb_report_drain(void) {
+    while (report_queue_length() && bit_is_set(UEINTX, TXINI)) {
+        const report_slot_t *slot = report_queue_front();
+        usb_report_load(slot);
+        usb_report_shipped(slot->stamp);
+        trace_report(TRACE_SHIPPED, report_queue_tail); /* in the bank, not yet polled */
+        report_queue_pop();
+    }
+#if !USB_REPORT_SOF_GATED
+    if (!report_queue_length()) {
+        UEIENX &= ~TXINE_SET; /* a free bank would interrupt forever */
+    }
+#endif
+}
+
+/*
+** Called from the main loop after queueing a report. Unless reports are SOF
+** gated, arm TXINI on EP1 so the report goes into a free bank right away and
+** is already waiting when the host's IN token arrives.
+*/
+void usb_report_ready(void) {
+#if !USB_REPORT_SOF_GATED
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (!usb_configuration_value || usb_suspended) {
             return;
         }
-        EP1_FIFO_RESET;
-        EP_FIFO_RESET_COMPLETE;
+        uint8_t endpoint = UENUM;
+        UENUM = KEYBOARD_IN_ENDPOINT;
+        UEIENX |= TXINE_SET;
+        UENUM = endpoint;
+    }
+#endif
+}
+
+/*
+** Raw interface, one packet deep each way. Each side disables its interrupt
+** while its buffer cannot move and usb_raw_ready() arms both again after
+** raw_task() answered. Until then a further OUT packet waits in the bank.
+*/
+static void usb_raw_send(void) {
+    if (raw_tx_full && bit_is_set(UEINTX, TXINI)) {
+        EP_IN_ACK;
+        for (uint8_t i = 0; i < RAW_REPORT_SIZE; ++i) {
+            UEDATX = raw_tx[i];
+        }
+        UEINTX &= ~_BV(FIFOCON);
+        raw_tx_full = false;
+    }
+    if (!raw_tx_full) {
+        UEIENX &= ~TXINE_SET; /* a free bank would interrupt forever */
+    }
+}
+
+static void usb_raw_receive(void) {
+    if (!raw_rx_full && bit_is_set(UEINTX, RXOUTI)) {
+        EP_OUT_ACK;
+        uint8_t count = UEBCLX; /* short packets are zero padded */
+        for (uint8_t i = 0; i < RAW_REPORT_SIZE; ++i) {
+            raw_rx[i] = i < count ? UEDATX : 0x00;
+        }
+        UEINTX &= ~_BV(FIFOCON);
+        raw_rx_full = true;
+    }
+    if (raw_rx_full) {
+        UEIENX &= ~RXOUTE_SET; /* the next packet waits in the bank */
+    }
+}
+
+/* Called from raw_task() after it took raw_rx and filled raw_tx */
+void usb_raw_ready(void) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (!usb_configuration_value || usb_suspended) {
+            return;
+        }
+        uint8_t endpoint = UENUM;
+        UENUM = RAW_IN_ENDPOINT;
+        UEIENX |= TXINE_SET;
+        UENUM = RAW_OUT_ENDPOINT;
+        UEIENX |= RXOUTE_SET;
+        UENUM = endpoint;
+    }
+}
+
+/*
+** Bring the endpoints back after a bus reset. Gives up at the first endpoint the
+** controller refuses to configure; the host resets again when enumeration stalls.
+*/
+static void usb_bus_reset(void) {
+    UENUM = 0;
+    EP_ENABLE;
+    UECFG0X = EPTYPE_CONTROL;
+    UECFG1X = EPSIZE_64BYTE | EPBK_ONEBANK | ALLOC_SET;
+    if (bit_is_clear(UESTA0X, CFGOK)) {
+        return;
+    }
+    EP0_FIFO_RESET;
+    EP_FIFO_RESET_COMPLETE;
+    usb_control.address = false;
+    usb_control_enter(USB_CONTROL_IDLE);
+
+    UENUM = KEYBOARD_IN_ENDPOINT;
+    EP_ENABLE;
+    UECONX = EPEN_SET;
+    UECFG0X = EPTYPE_INTERRUPT | EPDIR_IN;
+    UECFG1X = EPSIZE_32BYTE | EPBK_TWOBANK | ALLOC_SET;
+    if (bit_is_clear(UESTA0X, CFGOK)) {
+        return;
+    }
+    EP1_FIFO_RESET;
+    EP_FIFO_RESET_COMPLETE;
+
+    UENUM = RAW_IN_ENDPOINT;
+    EP_ENABLE;
+    UECFG0X = EPTYPE_INTERRUPT | EPDIR_IN;
+    UECFG1X = EPSIZE_64BYTE | EPBK_ONEBANK | ALLOC_SET;
+    if (bit_is_clear(UESTA0X, CFGOK)) {
+        return;
+    }
+    EP2_FIFO_RESET;
+    EP_FIFO_RESET_COMPLETE;
+
+    UENUM = RAW_OUT_ENDPOINT;
+    EP_ENABLE;
+    UECFG0X = EPTYPE_INTERRUPT | EPDIR_OUT;
+    UECFG1X = EPSIZE_64BYTE | EPBK_ONEBANK | ALLOC_SET;
+    if (bit_is_clear(UESTA0X, CFGOK)) {
+        return;
+    }
+    EP3_FIFO_RESET;
+    EP_FIFO_RESET_COMPLETE;
+    UEIENX = RXOUTE_SET;
+    raw_rx_full = false;
+    raw_tx_full = false;
+
+    UDIEN = EORSTE_SET | SOFE_SET | SUSPE_SET;
+    usb_suspended = false;
+    usb_remote_wakeup_enabled = false;
 
-        UDIEN = EORSTE_SET | SOFE_SET;
+    /* Devices come out of reset in report protocol */
+    report_protocol = REPORT_PROTOCOL_REPORT;
+    usb_idle_rate = 125;
+    LOG("usb: reset");
+}
+
+ISR(USB_GEN_vect, ISR_BLOCK) {
+    PROFILE_BEGIN(PROFILE_USB_GEN);
+    if (bit_is_set(UDINT, EORSTI)) {
+        UDINT &= ~_BV(EORSTI);
+        usb_bus_reset();
+    }
+    if (bit_is_set(UDIEN, SUSPE) && bit_is_set(UDINT, SUSPI)) {
+        /* 3 ms of bus idle, drop to suspend current: stop the clock and the PLL */
+        UDINT &= ~(_BV(SUSPI) | _BV(WAKEUPI));
+        UDIEN = (UDIEN & ~SUSPE_SET) | WAKEUPE_SET;
+        USBCON |= _BV(FRZCLK);
+        PLLCSR &= ~_BV(PLLE);
+        usb_suspended = true;
+        usb_suspend_stamp = scheduler_timestamp();
+        LOG("usb: suspend");
+    }
+    if (bit_is_set(UDIEN, WAKEUPE) && bit_is_set(UDINT, WAKEUPI)) {
+        /* Bus activity while suspended, usb_task() takes it from here */
+        usb_clock_start();
     }
     if (bit_is_set(UDINT, SOFI)) {
         UDINT &= ~_BV(SOFI);
+        scheduler_sof();
+        trace_sof();
         if (usb_configuration_value) {
-            /* TODO: implement Start Of Frame behavior */
-            UENUM = 1;
-            if (usb_ep_data_ready && bit_is_set(UEINTX, TXINI)) {
-                EP_IN_ACK;
-                if (bit_is_set(UEINTX, RWAL)) {
-                    for (uint8_t i = 0; i < sizeof(usb_ep_data_buffer); ++i) {
-                        UEDATX = usb_ep_data_buffer[i];
-                    }
-                }
-                usb_ep_data_ready = false;
-                UEINTX &= ~_BV(FIFOCON);
+            UENUM = KEYBOARD_IN_ENDPOINT;
+            if (usb_idle_elapsed != 0xFFFF) {
+                ++usb_idle_elapsed;
+            }
+#if USB_REPORT_SOF_GATED
+            usb_report_drain();
+#endif
+            /*
+            ** Repeat the last report sent when nothing changed for the idle
+            ** period. Only with the queue empty: queued reports go first, and
+            ** then the newest slot is the one that went out last.
+            */
+            if (usb_idle_rate && usb_idle_elapsed >= usb_idle_rate * 4 && !report_queue_length()
+                && bit_is_set(UEINTX, TXINI)) {
+                usb_report_load(report_queue_back());
             }
         }
     }
+    PROFILE_END(PROFILE_USB_GEN);
 }
 
 ISR(USB_COM_vect, ISR_BLOCK) {
+    PROFILE_BEGIN(PROFILE_USB_COM);
+#if !USB_REPORT_SOF_GATED
+    if (UEINT & _BV(KEYBOARD_IN_ENDPOINT)) {
+        UENUM = KEYBOARD_IN_ENDPOINT;
+        usb_report_drain();
+    }
+#endif
+    if (UEINT & _BV(RAW_IN_ENDPOINT)) {
+        UENUM = RAW_IN_ENDPOINT;
+        usb_raw_send();
+    }
+    if (UEINT & _BV(RAW_OUT_ENDPOINT)) {
+        UENUM = RAW_OUT_ENDPOINT;
+        usb_raw_receive();
+    }
     UENUM = 0;
     if (bit_is_set(UEINTX, RXSTPI)) {
         request_t req;
@@ -71,57 +479,39 @@ ISR(USB_COM_vect, ISR_BLOCK) {
         req.wLengthH = UEDATX;
         req.wLength = req.wLengthH << 8 | req.wLengthL;
 
+        /* A SETUP packet always starts over, whatever was in flight */
+        usb_control.address = false;
+        usb_control_enter(USB_CONTROL_IDLE);
+
         switch (req.bRequest << 8 | req.bmRequestType) {
             case REQ(CLEAR_FEATURE, HOST_TO_DEVICE, STANDARD, DEVICE):
+            case REQ(SET_FEATURE, HOST_TO_DEVICE, STANDARD, DEVICE):
+                if (req.wValue != DEVICE_REMOTE_WAKEUP) {
+                    EP_STALL_REQUEST;
+                    break;
+                }
+                EP_SETUP_ACK;
+                usb_remote_wakeup_enabled = req.bRequest == SET_FEATURE;
+                usb_control_status();
+                break;
             case REQ(CLEAR_FEATURE, HOST_TO_DEVICE, STANDARD, INTERFACE):
             case REQ(CLEAR_FEATURE, HOST_TO_DEVICE, STANDARD, ENDPOINT):
                 EP_STALL_REQUEST;
                 break;
             case REQ(GET_CONFIGURATION, DEVICE_TO_HOST, STANDARD, DEVICE):
                 EP_SETUP_ACK;
-                loop_until_bit_is_set(UEINTX, TXINI);
-                UEDATX = usb_configuration_value;
-                EP_IN_ACK;
-                loop_until_bit_is_set(UEINTX, RXOUTI);
-                EP_OUT_ACK;
+                usb_control_buffer[0] = usb_configuration_value;
+                usb_control_in(1, req.wLength);
                 break;
             case REQ(GET_DESCRIPTOR, DEVICE_TO_HOST, STANDARD, DEVICE):
                 switch (req.wValueH) {
                     case DEVICE:
                         EP_SETUP_ACK;
-                        if (req.wLength > sizeof(device_descriptor)) {
-                            req.wLength = sizeof(device_descriptor);
-                        }
-                        for (uint16_t i = 0; i < req.wLength; ++i) {
-                            UEDATX = pgm_read_byte((uint8_t *)&device_descriptor + i);
-                        }
-                        EP_IN_ACK;
-                        loop_until_bit_is_set(UEINTX, RXOUTI);
-                        EP_OUT_ACK;
+                        usb_control_in_P(&usb_descriptors.device, sizeof(usb_descriptors.device), req.wLength);
                         break;
                     case CONFIGURATION:
                         EP_SETUP_ACK;
-                        if (req.wLength == sizeof(configuration_descriptor)) {
-                            for (uint8_t i = 0; i < req.wLength; ++i) {
-                                UEDATX = pgm_read_byte((uint8_t *)&configuration_descriptor + i);
-                            }
-                        } else {
-                            for (uint8_t i = 0; i < sizeof(configuration_descriptor_t); ++i) {
-                                UEDATX = pgm_read_byte((uint8_t *)&configuration_descriptor + i);
-                            }
-                            for (uint8_t i = 0; i < sizeof(interface_descriptor_t); ++i) {
-                                UEDATX = pgm_read_byte((uint8_t *)&interface_descriptor + i);
-                            }
-                            for (uint8_t i = 0; i < sizeof(HID_descriptor_t); ++i) {
-                                UEDATX = pgm_read_byte((uint8_t *)&HID_descriptor + i);
-                            }
-                            for (uint8_t i = 0; i < sizeof(endpoint_descriptor_t); ++i) {
-                                UEDATX = pgm_read_byte((uint8_t *)&endpoint_descriptor + i);
-                            }
-                        }
-                        EP_IN_ACK;
-                        loop_until_bit_is_set(UEINTX, RXOUTI);
-                        EP_OUT_ACK;
+                        usb_control_in_P(&usb_descriptors.set, sizeof(usb_descriptors.set), req.wLength);
                         break;
                     case STRING:
                     case INTERFACE:
@@ -135,40 +525,37 @@ ISR(USB_COM_vect, ISR_BLOCK) {
                 break;
             case REQ(GET_INTERFACE, DEVICE_TO_HOST, STANDARD, INTERFACE):
                 EP_SETUP_ACK;
-                loop_until_bit_is_set(UEINTX, TXINI);
-                UEDATX = 0x00; /* No alternate setting is supported */
-                EP_IN_ACK;
-                loop_until_bit_is_set(UEINTX, RXOUTI);
-                EP_OUT_ACK;
+                usb_control_buffer[0] = 0x00; /* No alternate setting is supported */
+                usb_control_in(1, req.wLength);
                 break;
             case REQ(GET_STATUS, DEVICE_TO_HOST, STANDARD, DEVICE):
+                EP_SETUP_ACK;
+                /* bus powered, bit 1 is the remote wakeup enable */
+                usb_control_buffer[0] = usb_remote_wakeup_enabled ? 0b10 : 0b00;
+                usb_control_buffer[1] = 0x00;
+                usb_control_in(2, req.wLength);
+                break;
             case REQ(GET_STATUS, DEVICE_TO_HOST, STANDARD, INTERFACE):
             case REQ(GET_STATUS, DEVICE_TO_HOST, STANDARD, ENDPOINT):
                 EP_SETUP_ACK;
-                loop_until_bit_is_set(UEINTX, TXINI);
-                /* always 0x0000 status no matter of recipient */
-                UEDATX = 0x00;
-                UEDATX = 0x00;
-                EP_IN_ACK;
-                loop_until_bit_is_set(UEINTX, RXOUTI);
-                EP_OUT_ACK;
+                /* always 0x0000 status for interfaces and endpoints */
+                usb_control_buffer[0] = 0x00;
+                usb_control_buffer[1] = 0x00;
+                usb_control_in(2, req.wLength);
                 break;
             case REQ(SET_ADDRESS, HOST_TO_DEVICE, STANDARD, DEVICE):
                 UDADDR = req.wValueL;
                 EP_SETUP_ACK;
-                loop_until_bit_is_set(UEINTX, TXINI);
-                EP_IN_ACK;
-                loop_until_bit_is_set(UEINTX, TXINI);
-                UDADDR |= ADDEN_SET;
+                usb_control.address = true;
+                usb_control_status();
                 break;
             case REQ(SET_CONFIGURATION, HOST_TO_DEVICE, STANDARD, DEVICE):
                 EP_SETUP_ACK;
                 usb_configuration_value = req.wValueL;
-                loop_until_bit_is_set(UEINTX, TXINI);
-                EP_IN_ACK;
+                LOG("usb: configuration %u", usb_configuration_value);
+                usb_control_status();
                 break;
             case REQ(SET_DESCRIPTOR, HOST_TO_DEVICE, STANDARD, DEVICE):
-            case REQ(SET_FEATURE, HOST_TO_DEVICE, STANDARD, DEVICE):
             case REQ(SET_FEATURE, HOST_TO_DEVICE, STANDARD, INTERFACE):
             case REQ(SET_FEATURE, HOST_TO_DEVICE, STANDARD, ENDPOINT):
             case REQ(SET_INTERFACE, HOST_TO_DEVICE, STANDARD, INTERFACE):
@@ -178,19 +565,20 @@ ISR(USB_COM_vect, ISR_BLOCK) {
             case REQ(GET_DESCRIPTOR, DEVICE_TO_HOST, STANDARD, INTERFACE):
                 switch (req.wValueH) {
                     case HID:
-                        EP_STALL_REQUEST;
+                        EP_SETUP_ACK;
+                        if (req.wIndexL == INTERFACE_RAW) {
+                            usb_control_in_P(&usb_descriptors.set.raw_HID, sizeof(HID_descriptor_t), req.wLength);
+                        } else {
+                            usb_control_in_P(&usb_descriptors.set.keyboard_HID, sizeof(HID_descriptor_t), req.wLength);
+                        }
                         break;
                     case REPORT:
                         EP_SETUP_ACK;
-                        if (req.wLength > sizeof(report_descriptor)) {
-                            req.wLength = sizeof(report_descriptor);
-                        }
-                        for (uint8_t i = 0; i < req.wLength; ++i) {
-                            UEDATX = pgm_read_byte(report_descriptor + i);
+                        if (req.wIndexL == INTERFACE_RAW) {
+                            usb_control_in_P(usb_descriptors.raw_report, sizeof(usb_descriptors.raw_report), req.wLength);
+                        } else {
+                            usb_control_in_P(usb_descriptors.keyboard_report, sizeof(usb_descriptors.keyboard_report), req.wLength);
                         }
-                        EP_IN_ACK;
-                        loop_until_bit_is_set(UEINTX, RXOUTI);
-                        EP_OUT_ACK;
                         break;
                     case PHYSICAL_DESCRIPTOR:
                     default:
@@ -198,13 +586,100 @@ ISR(USB_COM_vect, ISR_BLOCK) {
                         break;
                 }
                 break;
-            case REQ(SET_DESCRIPTOR, DEVICE_TO_HOST, STANDARD, INTERFACE):
             case REQ(GET_REPORT, DEVICE_TO_HOST, CLASS, INTERFACE):
+                if (req.wIndexL != INTERFACE_KEYBOARD) {
+                    EP_STALL_REQUEST; /* raw interface reports only travel on EP2/EP3 */
+                    break;
+                }
+                switch (req.wValue) {
+                    case 0x01 << 8 | REPORT_ID_KEYBOARD: /* Input */
+                    case 0x01 << 8 | 0: /* Input, boot protocol */
+                        EP_SETUP_ACK;
+                        usb_control_in(report_convert(report_queue_back(), usb_control_buffer), req.wLength);
+                        break;
+#ifndef NDEBUG
+                    case 0x03 << 8 | REPORT_ID_PROFILE: /* Feature */
+                        EP_SETUP_ACK;
+                        usb_control_in(profile_report(usb_control_buffer), req.wLength);
+                        break;
+#endif
+                    default:
+                        EP_STALL_REQUEST;
+                        break;
+                }
+                break;
             case REQ(GET_IDLE, DEVICE_TO_HOST, CLASS, INTERFACE):
+                if (req.wIndexL != INTERFACE_KEYBOARD) {
+                    EP_STALL_REQUEST; /* raw interface reports only travel on EP2/EP3 */
+                    break;
+                }
+                EP_SETUP_ACK;
+                usb_control_buffer[0] = usb_idle_rate;
+                usb_control_in(1, req.wLength);
+                break;
             case REQ(GET_PROTOCOL, DEVICE_TO_HOST, CLASS, INTERFACE):
+                if (req.wIndexL != INTERFACE_KEYBOARD) {
+                    EP_STALL_REQUEST; /* raw interface reports only travel on EP2/EP3 */
+                    break;
+                }
+                EP_SETUP_ACK;
+                usb_control_buffer[0] = report_protocol;
+                usb_control_in(1, req.wLength);
+                break;
             case REQ(SET_REPORT, HOST_TO_DEVICE, CLASS, INTERFACE):
+                if (req.wIndexL != INTERFACE_KEYBOARD) {
+                    EP_STALL_REQUEST; /* raw interface reports only travel on EP2/EP3 */
+                    break;
+                }
+                /* LED output report of boot keyboards, accepted and ignored */
+                EP_SETUP_ACK;
+                usb_control_out(req.wLength);
+                break;
             case REQ(SET_IDLE, HOST_TO_DEVICE, CLASS, INTERFACE):
+                EP_SETUP_ACK;
+                if (req.wIndexL == INTERFACE_KEYBOARD) {
+                    usb_idle_rate = req.wValueH;
+                    usb_idle_elapsed = 0;
+                }
+                usb_control_status();
+                break;
             case REQ(SET_PROTOCOL, HOST_TO_DEVICE, CLASS, INTERFACE):
+                if (req.wIndexL != INTERFACE_KEYBOARD) {
+                    EP_STALL_REQUEST; /* raw interface reports only travel on EP2/EP3 */
+                    break;
+                }
+                EP_SETUP_ACK;
+                /* Queued reports are converted as they go out, see report_convert() */
+                report_protocol = req.wValueL ? REPORT_PROTOCOL_REPORT : REPORT_PROTOCOL_BOOT;
+                usb_control_status();
+                break;
+            case REQ(KEYMAP_REQUEST_GET_KEY, DEVICE_TO_HOST, VENDOR, DEVICE):
+                if (!keymap_get(req.wValueH, req.wValueL, req.wIndexL, &usb_control_buffer[0])) {
+                    EP_STALL_REQUEST;
+                    break;
+                }
+                EP_SETUP_ACK;
+                usb_control_in(1, req.wLength);
+                break;
+            case REQ(KEYMAP_REQUEST_SET_KEY, HOST_TO_DEVICE, VENDOR, DEVICE):
+                if (!keymap_set(req.wValueH, req.wValueL, req.wIndexL, req.wIndexH)) {
+                    EP_STALL_REQUEST;
+                    break;
+                }
+                EP_SETUP_ACK;
+                usb_control_status();
+                break;
+            case REQ(KEYMAP_REQUEST_RESET_KEYS, HOST_TO_DEVICE, VENDOR, DEVICE):
+                EP_SETUP_ACK;
+                keymap_reset();
+                usb_control_status();
+                break;
+            case REQ(KEYMAP_REQUEST_GET_FREE, DEVICE_TO_HOST, VENDOR, DEVICE):
+                EP_SETUP_ACK;
+                usb_control_buffer[0] = keymap_free();
+                usb_control_in(1, req.wLength);
+                break;
+            case REQ(SET_DESCRIPTOR, DEVICE_TO_HOST, STANDARD, INTERFACE):
             default:
                 EP_STALL_REQUEST;
                 break;
@@ -215,4 +690,13 @@ ISR(USB_COM_vect, ISR_BLOCK) {
         UEINTX &= ~_BV(RXSTPI);
         UECONX |= _BV(STALLRQ);
     }
+
+    usb_control_service();
+
+#ifndef NDEBUG
+    if (bit_is_set(UDINT, SOFI)) {
+        ++profile_sof_blocked;
+    }
+#endif
+    PROFILE_END(PROFILE_USB_COM);
 }
@@ -4,12 +4,27 @@
 #include <stdint.h>
 #include <avr/pgmspace.h>
 
+/* EP1 bInterval in frames, 1 for 1 ms polling */
+#ifndef USB_POLL_INTERVAL
+#define USB_POLL_INTERVAL 16
+#endif
+static_assert(USB_POLL_INTERVAL >= 1 && USB_POLL_INTERVAL <= 255);
+
+/* 1: load EP1 only on SOF, 0: load it on TXINI as soon as a report is queued */
+#ifndef USB_REPORT_SOF_GATED
+#define USB_REPORT_SOF_GATED 0
+#endif
+
 #define EORSTE_SET (0b1 << 3)
 #define SOFE_SET (0b1 << 2)
+#define SUSPE_SET (0b1 << 0)
+#define WAKEUPE_SET (0b1 << 4)
 #define ADDEN_SET (0b1 << 7);
 
 #define EP0_FIFO_RESET do { UERST |= _BV(EPRST0); } while (false)
 #define EP1_FIFO_RESET do { UERST |= _BV(EPRST1); } while (false)
+#define EP2_FIFO_RESET do { UERST |= _BV(EPRST2); } while (false)
+#define EP3_FIFO_RESET do { UERST |= _BV(EPRST3); } while (false)
 #define EP_FIFO_RESET_COMPLETE do { UERST = 0x00; } while (false)
 #define EP_STALL_REQUEST do { UECONX |= _BV(STALLRQ); } while (false)
 #define EP_ENABLE do { UECONX |= _BV(EPEN); } while (false)
@@ -17,15 +32,38 @@
 #define EPTYPE_CONTROL (0b00 << 6)
 #define EPTYPE_INTERRUPT (0b11 << 6)
 #define EPDIR_IN (0b1 << 0)
+#define EPDIR_OUT (0b0 << 0)
 #define EPSIZE_8BYTE (0b000 << 4)
 #define EPSIZE_32BYTE (0b010 << 4)
 #define EPSIZE_64BYTE (0b011 << 4)
 #define EPBK_ONEBANK (0b00 << 2)
+#define EPBK_TWOBANK (0b01 << 2)
 #define ALLOC_SET (0b01 << 1)
 #define EP_SETUP_ACK do { UEINTX &= ~_BV(RXSTPI); } while (false)
 #define EP_OUT_ACK do { UEINTX &= ~_BV(RXOUTI); } while (false)
 #define EP_IN_ACK do { UEINTX &= ~_BV(TXINI); } while (false)
 #define RXSTPE_SET (0b1 << 3)
+#define RXOUTE_SET (0b1 << 2)
+#define TXINE_SET (0b1 << 0)
+
+#define INTERFACE_KEYBOARD 0
+#define INTERFACE_RAW 1
+
+#define KEYBOARD_IN_ENDPOINT 1
+#define RAW_IN_ENDPOINT 2
+#define RAW_OUT_ENDPOINT 3
+
+extern volatile bool usb_suspended;
+extern volatile bool usb_remote_wakeup_enabled;
+extern volatile uint16_t usb_resume_us;
+extern volatile uint16_t usb_resume_max_us;
+extern volatile uint16_t usb_report_staleness_us;
+extern volatile uint16_t usb_report_staleness_max_us;
+
+void usb_report_ready(void);
+void usb_raw_ready(void);
+void usb_remote_wakeup(void);
+void usb_task(void);
 
 typedef struct {
     uint8_t bmRequestType;
@@ -152,6 +190,11 @@ enum {
     SET_PROTOCOL = 0x0B,
 };
 
+enum {
+    ENDPOINT_HALT = 0,
+    DEVICE_REMOTE_WAKEUP = 1,
+};
+
 enum {
     DEVICE = 1,
     CONFIGURATION = 2,
@@ -1,87 +1,191 @@
 #include <avr/pgmspace.h>
 #include "usb.h"
+#include "report.h"
+#include "profile.h"
+#include "raw.h"
 
-static const device_descriptor_t device_descriptor PROGMEM = {
-    .bLength = sizeof(device_descriptor_t),
-    .bDescriptorType = DEVICE,
-    .bcdUSB = 0x0200,
-    .bDeviceClass = 0x00,
-    .bDeviceSubClass = 0x00,
-    .bDeviceProtocol = 0x00,
-    .bMaxPacketSize0 = 64,
-    .idVendor = 0xF055,
-    .idProduct = 0x0000,
-    .bcdDevice = 0x0100,
-    .iManufacturer = 0,
-    .iProduct = 0,
-    .iSerialNumber = 0,
-    .bNumConfigurations = 1,
-};
-
-static const configuration_descriptor_t configuration_descriptor PROGMEM = {
-    .bLength = sizeof(configuration_descriptor_t),
-    .bDescriptorType = CONFIGURATION,
-    .wTotalLength = sizeof(configuration_descriptor_t) + sizeof(interface_descriptor_t) + sizeof(endpoint_descriptor_t) + sizeof(HID_descriptor_t),
-    .bNumInterfaces = 1,
-    .bConfigurationValue = 1,
-    .iConfiguration = 0,
-    .bmAttributes = 0b10000000,
-    .bMaxPower = 100 / 2,
-};
+/*
+** Every descriptor lives in one packed flash object. The configuration set
+** is a single member, so wTotalLength is its sizeof and a GET_DESCRIPTOR is
+** one contiguous read at a fixed offset.
+*/
 
-static const interface_descriptor_t interface_descriptor PROGMEM = {
-    .bLength = sizeof(interface_descriptor_t),
-    .bDescriptorType = INTERFACE,
-    .bInterfaceNumber = 0,
-    .bAlternateSetting = 0,
-    .bNumEndpoints = 1,
-    .bInterfaceClass = 0x03,
-    .bInterfaceSubClass = 0,
-    .bInterfaceProtocol = 0,
-    .iInterface = 0,
-};
+#define USB_KEYBOARD_REPORT_DESCRIPTOR \
+    0b0000'01'01, 0x01, /* Usage Page (Generic Desktop) */ \
+    0b0000'10'01, 0x06, /* Usage (Keyboard) */ \
+    0b1010'00'01, 0x01, /* Collection (Application) */ \
+    0b1000'01'01, REPORT_ID_KEYBOARD, /*   Report ID */ \
+    0b0000'01'01, 0x07, /* Usage Page (Keyboard/Keypad) */ \
+    0b0001'10'01, 0xE0, /*   Usage Minimum (0xE0) */ \
+    0b0010'10'01, 0xE7, /*   Usage Maximum (0xE7) */ \
+    0b0001'01'01,    0, /*   Logical Minimum (0) */ \
+    0b0010'01'01,    1, /*   Logical Maximum (1) */ \
+    0b0111'01'01,    1, /*   Report Size (1) */ \
+    0b1001'01'01,    8, /*   Report Count (8) */ \
+    0b1000'00'01, 0x02, /*   Input (Data, Variable, Absolute) */ \
+    0b0001'10'01, 0x00, /*   Usage Minimum (0x00) */ \
+    0b0010'10'01, 0xA4, /*   Usage Maximum (0xA4) */ \
+    0b0001'01'01,    0, /*   Logical Minimum (0) */ \
+    0b0010'01'01,    1, /*   Logical Maximum (1) */ \
+    0b0111'01'01,    1, /*   Report Size (1) */ \
+    0b1001'01'01,  165, /*   Report Count (165) */ \
+    0b1000'00'01, 0x02, /*   Input (Data, Variable, Absolute) */ \
+    0b0111'01'01,    1, /*   Report Size (1) */ \
+    0b1001'01'01,    3, /*   Report Count (3) */ \
+    0b1000'00'01, 0x03, /*   Input (Constant, Variable, Absolute) */ \
+    0b1100'00'00,       /* End Collection */ \
+    USB_PROFILE_REPORT_DESCRIPTOR
 
-static const endpoint_descriptor_t endpoint_descriptor PROGMEM = {
-    .bLength = sizeof(endpoint_descriptor_t),
-    .bDescriptorType = ENDPOINT,
-    .bEndpointAddress = 0b10000001,
-    .bmAttributes = 0b00000011,
-    .wMaxPacketSize = 0b00000000'00100000,
-    .bInterval = 16,
-};
+#ifndef NDEBUG
+#define USB_PROFILE_REPORT_DESCRIPTOR \
+    0b0000'01'10, 0x00, 0xFF, /* Usage Page (Vendor Defined 0xFF00) */ \
+    0b0000'10'01, 0x01, /* Usage (Profile) */ \
+    0b1010'00'01, 0x01, /* Collection (Application) */ \
+    0b1000'01'01, REPORT_ID_PROFILE, /*   Report ID */ \
+    0b0000'10'01, 0x02, /*   Usage (Counters) */ \
+    0b0001'01'01,    0, /*   Logical Minimum (0) */ \
+    0b0010'01'10, 0xFF, 0x00, /*   Logical Maximum (255) */ \
+    0b0111'01'01,    8, /*   Report Size (8) */ \
+    0b1001'01'01, PROFILE_REPORT_SIZE - 1, /*   Report Count */ \
+    0b1011'00'01, 0x02, /*   Feature (Data, Variable, Absolute) */ \
+    0b1100'00'00,       /* End Collection */
+#else
+#define USB_PROFILE_REPORT_DESCRIPTOR
+#endif
 
-static const uint8_t report_descriptor[] PROGMEM = {
-    0b0000'01'01, 0x01, /* Usage Page (Generic Desktop) */
-    0b0000'10'01, 0x06, /* Usage (Keyboard) */
-    0b1010'00'01, 0x01, /* Collection (Application) */
-    0b0000'01'01, 0x07, /* Usage Page (Keyboard/Keypad) */
-    0b0001'10'01, 0xE0, /*   Usage Minimum (0xE0) */
-    0b0010'10'01, 0xE7, /*   Usage Maximum (0xE7) */
-    0b0001'01'01,    0, /*   Logical Minimum (0) */
-    0b0010'01'01,    1, /*   Logical Maximum (1) */
-    0b0111'01'01,    1, /*   Report Size (1) */
-    0b1001'01'01,    8, /*   Report Count (8) */
-    0b1000'00'01, 0x02, /*   Input (Data, Variable, Absolute) */
-    0b0001'10'01, 0x00, /*   Usage Minimum (0x00) */
-    0b0010'10'01, 0xA4, /*   Usage Maximum (0xA4) */
-    0b0001'01'01,    0, /*   Logical Minimum (0) */
-    0b0010'01'01,    1, /*   Logical Maximum (1) */
-    0b0111'01'01,    1, /*   Report Size (1) */
-    0b1001'01'01,  165, /*   Report Count (165) */
-    0b1000'00'01, 0x02, /*   Input (Data, Variable, Absolute) */
-    0b0111'01'01,    1, /*   Report Size (1) */
-    0b1001'01'01,    3, /*   Report Count (3) */
-    0b1000'00'01, 0x03, /*   Input (Constant, Variable, Absolute) */
+#define USB_RAW_REPORT_DESCRIPTOR \
+    0b0000'01'10, 0x60, 0xFF, /* Usage Page (Vendor Defined 0xFF60) */ \
+    0b0000'10'01, 0x61, /* Usage (0x61) */ \
+    0b1010'00'01, 0x01, /* Collection (Application) */ \
+    0b0001'01'01,    0, /*   Logical Minimum (0) */ \
+    0b0010'01'10, 0xFF, 0x00, /*   Logical Maximum (255) */ \
+    0b0111'01'01,    8, /*   Report Size (8) */ \
+    0b0000'10'01, 0x62, /*   Usage (0x62) */ \
+    0b1001'01'01, RAW_REPORT_SIZE, /*   Report Count */ \
+    0b1000'00'01, 0x02, /*   Input (Data, Variable, Absolute) */ \
+    0b0000'10'01, 0x63, /*   Usage (0x63) */ \
+    0b1001'01'01, RAW_REPORT_SIZE, /*   Report Count */ \
+    0b1001'00'01, 0x02, /*   Output (Data, Variable, Absolute) */ \
     0b1100'00'00,       /* End Collection */
-};
 
-static const HID_descriptor_t HID_descriptor PROGMEM = {
-    .bLength = sizeof(HID_descriptor_t),
-    .bDescriptorType = HID,
-    .bcdHID = 0x0111,
-    .bCountryCode = 0,
-    .bNumDescriptors = 1,
-    .bReportDescriptorType = REPORT,
-    .wReportDescriptorLength = sizeof(report_descriptor),
-};
+#define USB_DESCRIPTOR_SIZE(...) sizeof((const uint8_t[]){ __VA_ARGS__ })
+
+/* What GET_DESCRIPTOR(CONFIGURATION) returns, in this order */
+typedef struct [[gnu::packed]] {
+    configuration_descriptor_t configuration;
+    interface_descriptor_t keyboard_interface;
+    HID_descriptor_t keyboard_HID;
+    endpoint_descriptor_t keyboard_endpoint;
+    interface_descriptor_t raw_interface;
+    HID_descriptor_t raw_HID;
+    endpoint_descriptor_t raw_in_endpoint;
+    endpoint_descriptor_t raw_out_endpoint;
+} usb_configuration_set_t;
+static_assert(sizeof(usb_configuration_set_t) == sizeof(configuration_descriptor_t)
+    + 2 * (sizeof(interface_descriptor_t) + sizeof(HID_descriptor_t)) + 3 * sizeof(endpoint_descriptor_t));
 
+typedef struct [[gnu::packed]] {
+    device_descriptor_t device;
+    usb_configuration_set_t set;
+    uint8_t keyboard_report[USB_DESCRIPTOR_SIZE(USB_KEYBOARD_REPORT_DESCRIPTOR)];
+    uint8_t raw_report[USB_DESCRIPTOR_SIZE(USB_RAW_REPORT_DESCRIPTOR)];
+} usb_descriptors_t;
+static_assert(sizeof(usb_descriptors_t) == sizeof(device_descriptor_t) + sizeof(usb_configuration_set_t)
+    + USB_DESCRIPTOR_SIZE(USB_KEYBOARD_REPORT_DESCRIPTOR) + USB_DESCRIPTOR_SIZE(USB_RAW_REPORT_DESCRIPTOR));
+
+static const usb_descriptors_t usb_descriptors PROGMEM = {
+    .device = {
+        .bLength = sizeof(device_descriptor_t),
+        .bDescriptorType = DEVICE,
+        .bcdUSB = 0x0200,
+        .bDeviceClass = 0x00,
+        .bDeviceSubClass = 0x00,
+        .bDeviceProtocol = 0x00,
+        .bMaxPacketSize0 = 64,
+        .idVendor = 0xF055,
+        .idProduct = 0x0000,
+        .bcdDevice = 0x0100,
+        .iManufacturer = 0,
+        .iProduct = 0,
+        .iSerialNumber = 0,
+        .bNumConfigurations = 1,
+    },
+    .set = {
+        .configuration = {
+            .bLength = sizeof(configuration_descriptor_t),
+            .bDescriptorType = CONFIGURATION,
+            .wTotalLength = sizeof(usb_configuration_set_t),
+            .bNumInterfaces = 2,
+            .bConfigurationValue = 1,
+            .iConfiguration = 0,
+            .bmAttributes = 0b10100000, /* bus powered, remote wakeup */
+            .bMaxPower = 100 / 2,
+        },
+        .keyboard_interface = {
+            .bLength = sizeof(interface_descriptor_t),
+            .bDescriptorType = INTERFACE,
+            .bInterfaceNumber = INTERFACE_KEYBOARD,
+            .bAlternateSetting = 0,
+            .bNumEndpoints = 1,
+            .bInterfaceClass = 0x03,
+            .bInterfaceSubClass = 1, /* Boot Interface */
+            .bInterfaceProtocol = 1, /* Keyboard */
+            .iInterface = 0,
+        },
+        .keyboard_HID = {
+            .bLength = sizeof(HID_descriptor_t),
+            .bDescriptorType = HID,
+            .bcdHID = 0x0111,
+            .bCountryCode = 0,
+            .bNumDescriptors = 1,
+            .bReportDescriptorType = REPORT,
+            .wReportDescriptorLength = USB_DESCRIPTOR_SIZE(USB_KEYBOARD_REPORT_DESCRIPTOR),
+        },
+        .keyboard_endpoint = {
+            .bLength = sizeof(endpoint_descriptor_t),
+            .bDescriptorType = ENDPOINT,
+            .bEndpointAddress = 0b10000000 | KEYBOARD_IN_ENDPOINT,
+            .bmAttributes = 0b00000011,
+            .wMaxPacketSize = 0b00000000'00100000,
+            .bInterval = USB_POLL_INTERVAL,
+        },
+        .raw_interface = {
+            .bLength = sizeof(interface_descriptor_t),
+            .bDescriptorType = INTERFACE,
+            .bInterfaceNumber = INTERFACE_RAW,
+            .bAlternateSetting = 0,
+            .bNumEndpoints = 2,
+            .bInterfaceClass = 0x03,
+            .bInterfaceSubClass = 0,
+            .bInterfaceProtocol = 0,
+            .iInterface = 0,
+        },
+        .raw_HID = {
+            .bLength = sizeof(HID_descriptor_t),
+            .bDescriptorType = HID,
+            .bcdHID = 0x0111,
+            .bCountryCode = 0,
+            .bNumDescriptors = 1,
+            .bReportDescriptorType = REPORT,
+            .wReportDescriptorLength = USB_DESCRIPTOR_SIZE(USB_RAW_REPORT_DESCRIPTOR),
+        },
+        .raw_in_endpoint = {
+            .bLength = sizeof(endpoint_descriptor_t),
+            .bDescriptorType = ENDPOINT,
+            .bEndpointAddress = 0b10000000 | RAW_IN_ENDPOINT,
+            .bmAttributes = 0b00000011,
+            .wMaxPacketSize = RAW_REPORT_SIZE,
+            .bInterval = 1,
+        },
+        .raw_out_endpoint = {
+            .bLength = sizeof(endpoint_descriptor_t),
+            .bDescriptorType = ENDPOINT,
+            .bEndpointAddress = 0b00000000 | RAW_OUT_ENDPOINT,
+            .bmAttributes = 0b00000011,
+            .wMaxPacketSize = RAW_REPORT_SIZE,
+            .bInterval = 1,
+        },
+    },
+    .keyboard_report = { USB_KEYBOARD_REPORT_DESCRIPTOR },
+    .raw_report = { USB_RAW_REPORT_DESCRIPTOR },
+};
@@ -7,6 +7,9 @@
 #define STRINGIFY_INTERNAL(x) #x
 #define STRINGIFY(x) STRINGIFY_INTERNAL(x)
 
+/* Keep the compiler from moving memory accesses across this point */
+#define COMPILER_BARRIER __asm__ __volatile__ ("" ::: "memory")
+
 #ifndef NDEBUG
 #define LED_PROVE_INIT do { DDRC |= _BV(DDC7); } while (false)
 #define LED_PROVE_HERE do { PORTC |= _BV(PORT7); _delay_ms(150); PORTC &= ~_BV(PORT7); _delay_ms(150); PORTC |= _BV(PORT7); } while (false)